@@ -32,9 +32,11 @@
 #include <unistd.h>
 #include <termios.h>
 #include <fcntl.h>
-#include <wiringPi.h>
-#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include "hal.h"
 #include "beep.h"
+#include "log.h"
 
 #define DitLen 2
 #define DahLen 5
@@ -42,12 +44,31 @@
 #define CharLen 5
 #define SpaceLen 8
 #define WPM 5
-#define msPerTick 50
+#define msPerTick 50 // at WPM, ticks scale with the requested wpm
+
+#define BEEP_QUEUE_LEN 8
+#define BEEP_MAX_MESSAGE 80
+
+typedef struct
+{
+	int wpm;
+	int priority;
+	char message[BEEP_MAX_MESSAGE];
+} beep_msg_t;
 
-volatile unsigned *timer;
 int mode_debug = 1;
 int BeepPin;
 
+static pthread_t beep_thread;
+static pthread_mutex_t beep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t beep_cond; // new message, cancel or exit
+static pthread_cond_t idle_cond; // queue drained
+static beep_msg_t queue[BEEP_QUEUE_LEN]; // in arrival order
+static int queue_count = 0;
+static int playing_priority = -1; // -1 while idle
+static int abort_current = 0;
+static int beep_exit = 0;
+
 char code[26][5] = {
 //      a     b       c       d      e    f       g      h       i     j             
 	".-", "-...", "-.-.", "-..", ".", "..-.", "--.", "....", "..", ".---", 
@@ -73,43 +94,135 @@ char punc[0][0] = {
  *********************************************************************************
  */
 
-int SendChar(char ch)
+/*
+ * Wait for the given number of ticks past the previous deadline. Deadlines
+ * are absolute, so time spent driving the pin does not accumulate as drift.
+ * Returns -1 if the message was cancelled or pre-empted.
+ */
+static int WaitTicks(struct timespec* deadline, int ticks, int tickms)
 {
-	int index, i;
+	int err = 0;
+	long ms = (long)ticks * tickms;
+
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&beep_lock);
+	while ((!abort_current) && (!beep_exit) && (err != ETIMEDOUT))
+		err = pthread_cond_timedwait(&beep_cond, &beep_lock, deadline);
+	err = (abort_current || beep_exit) ? -1 : 0;
+	pthread_mutex_unlock(&beep_lock);
+
+	return err;
+}
+
+int SendChar(char ch, struct timespec* deadline, int tickms)
+{
+	int i, err;
+	char* pattern;
 	char ditdahchar;
 	
 	if ( (ch > 96) && (ch < 123) ) // lower case
-		index = ch - 97; 
+		pattern = code[ch - 97]; 
 	else if ( (ch > 64) && (ch < 91) ) // capitals
-		index = ch - 65;
+		pattern = code[ch - 65];
 	else if ( (ch > 48) && (ch < 58) ) // numbers
-		index = ch - 49;
+		pattern = num[ch - 49];
 	else if (ch == 48)  // 0
-		index = 10;
+		pattern = num[9];
 	else
-		return -1;
+		return 0;
 		
-	for (ditdahchar = code[index][0], i = 0; ditdahchar != '\0'; i++, ditdahchar = code[index][i])
+	for (ditdahchar = pattern[0], i = 0; ditdahchar != '\0'; i++, ditdahchar = pattern[i])
 	{
-		if (mode_debug)
-			printf("%c", ditdahchar);
-
-		digitalWrite(BeepPin, HIGH);
-		if (ditdahchar == '.')
-			usleep(msPerTick * DitLen * 1000);
-		else // assume "-"
-			usleep(msPerTick * DahLen * 1000);
-		digitalWrite(BeepPin, LOW);
+		hal_digital_write(BeepPin, HAL_HIGH);
+		err = WaitTicks(deadline, (ditdahchar == '.') ? DitLen : DahLen, tickms);
+		hal_digital_write(BeepPin, HAL_LOW);
 
-		usleep(msPerTick * DitDahSpaceLen * 1000);
+		if (err || WaitTicks(deadline, DitDahSpaceLen, tickms))
+			return -1;
 	}
-	
-	if (mode_debug)
-		printf("|");
 
 	return 0;
 }
 
+static void PlayMessage(beep_msg_t* msg)
+{
+	char* ch = msg->message;
+	int tickms;
+	struct timespec deadline;
+
+	tickms = (msPerTick * WPM) / ((msg->wpm > 0) ? msg->wpm : WPM);
+	if (tickms < 1)
+		tickms = 1;
+
+	if (mode_debug)
+		log_debug("Morse at %d wpm: %s", (msg->wpm > 0) ? msg->wpm : WPM, msg->message);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	
+	while (*ch != '\0')
+	{
+		if (*ch == ' ')
+		{
+			if (WaitTicks(&deadline, SpaceLen, tickms))
+				break;
+		}
+		else
+		{
+			if (WaitTicks(&deadline, CharLen, tickms) || SendChar(*ch, &deadline, tickms))
+				break;
+		}
+		ch++;
+	}
+}
+
+void *thread_beeper(void *ptr)
+{
+	beep_msg_t msg;
+	int i, next;
+
+	pthread_mutex_lock(&beep_lock);
+	while (!beep_exit)
+	{
+		if (queue_count == 0)
+		{
+			playing_priority = -1;
+			pthread_cond_broadcast(&idle_cond);
+			pthread_cond_wait(&beep_cond, &beep_lock);
+			continue;
+		}
+
+		// Highest priority first, oldest first within a priority
+		next = 0;
+		for (i = 1; i < queue_count; i++)
+			if (queue[i].priority > queue[next].priority)
+				next = i;
+		msg = queue[next];
+		memmove(&queue[next], &queue[next + 1], (queue_count - next - 1) * sizeof(beep_msg_t));
+		queue_count--;
+
+		playing_priority = msg.priority;
+		abort_current = 0;
+		pthread_mutex_unlock(&beep_lock);
+
+		PlayMessage(&msg);
+
+		pthread_mutex_lock(&beep_lock);
+	}
+	playing_priority = -1;
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&beep_lock);
+
+	hal_digital_write(BeepPin, HAL_LOW);
+	return NULL;
+}
+
 /*
  *********************************************************************************
  * access functions
@@ -119,39 +232,96 @@ int SendChar(char ch)
 int BeepInit (int beeppin, int debug)
 {
 	int err = 0;
+	pthread_condattr_t attr;
 	
 	BeepPin = beeppin;
 	mode_debug = debug;
 	
-	digitalWrite(BeepPin, LOW);
-	pinMode(BeepPin, OUTPUT);
+	hal_digital_write(BeepPin, HAL_LOW);
+	hal_pin_mode(BeepPin, HAL_OUTPUT);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&beep_cond, &attr);
+	pthread_cond_init(&idle_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	err = pthread_create(&beep_thread, NULL, thread_beeper, NULL);
+	if (err)
+		log_error("Error - pthread_create() fail");
 
 	return err;
 }
 
-int BeepMorse(int wpm, char* message)
+int BeepQueue(int wpm, char* message, int priority)
 {
-	char* msg = message;
-	
-	while (*msg != '\0')
+	pthread_mutex_lock(&beep_lock);
+	if (queue_count == BEEP_QUEUE_LEN)
 	{
-		if (*msg == ' ')
-		{
-			usleep(msPerTick * SpaceLen * 1000);
-			if (mode_debug)
-				printf(" ");
-		}
-		else
-		{
-			usleep(msPerTick * CharLen * 1000);
-			SendChar(*msg);
-		}
-		msg++;
+		pthread_mutex_unlock(&beep_lock);
+		return -1;
 	}
-	
-	if (mode_debug)
-		printf("\n");
+
+	queue[queue_count].wpm = wpm;
+	queue[queue_count].priority = priority;
+	strncpy(queue[queue_count].message, message, BEEP_MAX_MESSAGE - 1);
+	queue[queue_count].message[BEEP_MAX_MESSAGE - 1] = '\0';
+	queue_count++;
+
+	// A more important message cuts the current one short
+	if ((playing_priority >= 0) && (priority > playing_priority))
+		abort_current = 1;
+
+	pthread_cond_broadcast(&beep_cond);
+	pthread_mutex_unlock(&beep_lock);
 	
 	return 0;
 }
 
+int BeepMorse(int wpm, char* message)
+{
+	return BeepQueue(wpm, message, BEEP_PRIORITY_NORMAL);
+}
+
+void BeepCancel(void)
+{
+	pthread_mutex_lock(&beep_lock);
+	queue_count = 0;
+	abort_current = 1;
+	pthread_cond_broadcast(&beep_cond);
+	pthread_mutex_unlock(&beep_lock);
+}
+
+int BeepDrain(int timeout_ms)
+{
+	struct timespec deadline;
+	int err = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&beep_lock);
+	while (((queue_count != 0) || (playing_priority >= 0)) && (err != ETIMEDOUT))
+		err = pthread_cond_timedwait(&idle_cond, &beep_lock, &deadline);
+	err = ((queue_count != 0) || (playing_priority >= 0)) ? -1 : 0;
+	pthread_mutex_unlock(&beep_lock);
+
+	return err;
+}
+
+void BeepStop(void)
+{
+	pthread_mutex_lock(&beep_lock);
+	beep_exit = 1;
+	queue_count = 0;
+	pthread_cond_broadcast(&beep_cond);
+	pthread_mutex_unlock(&beep_lock);
+
+	pthread_join(beep_thread, NULL);
+}
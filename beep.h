@@ -28,7 +28,20 @@
 #ifndef BEEP_H
 #define BEEP_H
 
+#define BEEP_PRIORITY_LOW 0
+#define BEEP_PRIORITY_NORMAL 1
+#define BEEP_PRIORITY_HIGH 2
+
+/*
+ * Messages are queued and played by a beeper thread, the calls return
+ * right away. A message of higher priority than the one playing cuts it
+ * short. BeepQueue and BeepMorse return -1 if the queue is full.
+ */
 int BeepInit (int beeppin, int debug);
 int BeepMorse(int wpm, char* message);
+int BeepQueue(int wpm, char* message, int priority);
+void BeepCancel(void);
+int BeepDrain(int timeout_ms); // wait until everything queued has played, -1 on timeout
+void BeepStop(void);
 
 #endif
\ No newline at end of file
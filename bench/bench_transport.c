@@ -0,0 +1,245 @@
+/*
+ * bench_transport.c:
+ *      Microbenchmarks of the transport hot paths: command lookup, value
+ *      formatting, push serialization and the subscription timer wheel
+ *
+ *	transport.c is compiled into this file so its static functions can
+ *	be timed directly. The handlers are started and stopped once to set
+ *	up the command index and push prefixes, then every case runs on this
+ *	thread alone, none of them send anything.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include "../transport.c"
+#include "../timing.h"
+
+#define BENCH_MIN_US 200000 // run each case at least this long
+#define BENCH_PORT 32101
+
+int sockfd;
+int rtiUdpPort = BENCH_PORT;
+
+static seqlock_t lock = SEQLOCK_INITIALIZER;
+static float distance = 24.3f;
+static float temp = 68.5f;
+static float humidity = 45.1f;
+static unsigned int alarm_level = 40;
+static unsigned int run_count = 1234;
+static float pump_rate = 0.75f;
+static char status[MAX_STRING_VALUE] = "Pump idle";
+static volatile int sink; // results go here so the work is not optimized away
+static session_t* bench_session;
+static wheel_t bench_wheel;
+static subscription_t bench_subs[MAX_SESSIONS * MAX_PUSH_TAGS]; // every session subscribed to every tag
+
+// Roughly what sump.c registers
+static commandlist_t bench_commands[] = {
+{ "GETDISTANCE",     "DISTANCE",     NULL, TYPE_FLOAT,   &distance,    7},
+{ "GETTEMP",         "TEMP",         NULL, TYPE_FLOAT,   &temp,        8},
+{ "GETHUMIDITY",     "HUMIDITY",     NULL, TYPE_FLOAT,   &humidity,    9},
+{ "SETALARMLEVEL",   "ALARMLEVEL",   NULL, TYPE_INTEGER, &alarm_level, 10},
+{ "GETRUNCOUNT",     "RUNCOUNT",     NULL, TYPE_INTEGER, &run_count,   11},
+{ "GETPUMPRATE",     "PUMPRATE",     NULL, TYPE_FLOAT,   &pump_rate,   12},
+{ "GETSTATUS",       "STATUS",       NULL, TYPE_STRING,  status,       13},
+{ "",                "",             NULL, TYPE_NULL,    NULL,         TP_ID_NONE}
+};
+
+static pushlist_t bench_pushlist[] = {
+{ "DISTANCE",     TYPE_FLOAT,   &distance,    0.1f, 0, 0},
+{ "TEMP",         TYPE_FLOAT,   &temp,        0.5f, 0, 0},
+{ "HUMIDITY",     TYPE_FLOAT,   &humidity,    1.0f, 0, 0},
+{ "ALARMLEVEL",   TYPE_INTEGER, &alarm_level, 0, 0, 0},
+{ "RUNCOUNT",     TYPE_INTEGER, &run_count,   0, 0, 0},
+{ "PUMPRATE",     TYPE_FLOAT,   &pump_rate,   0, 0, 0},
+{ "STATUS",       TYPE_STRING,  status,       0, 0, 0},
+{ "",             TYPE_NULL,    NULL,         0, 0, 0}
+};
+
+// A mix of hits, near misses and garbage, as a request handler sees them
+static const char* lookups[] = {
+	"GETDISTANCE\r\n", "GETTEMP\r\n", "SETALARMLEVEL=42\r\n", "GETSTATS\r\n",
+	"SETPAIR=1\r\n", "GETDISTANCF\r\n", "PING\r\n", "GETSTATUS\r\n"
+};
+#define LOOKUP_COUNT (sizeof(lookups) / sizeof(lookups[0]))
+
+typedef void (*bench_case_t)(int i);
+
+/*
+ *********************************************************************************
+ * cases
+ *********************************************************************************
+ */
+
+static void case_lookup(int i)
+{
+	int toklen;
+
+	sink += (cmd_lookup(lookups[i % LOOKUP_COUNT], &toklen) != NULL);
+}
+
+static void case_format_integer(int i)
+{
+	char buf[ENTRY_MAX];
+	tp_value_t value;
+
+	value.type = TYPE_INTEGER;
+	value.v.u = i;
+	sink += value_format(buf, &push_prefix[4], &value);
+}
+
+static void case_format_float(int i)
+{
+	char buf[ENTRY_MAX];
+	tp_value_t value;
+
+	value.type = TYPE_FLOAT;
+	value.v.f = (float)(i & 1023) * 0.37f;
+	sink += value_format(buf, &push_prefix[0], &value);
+}
+
+static void case_text_response(int i)
+{
+	char mesg[] = "GETDISTANCE\r\n";
+	char sendmesg[PUSH_MTU];
+	commandlist_t* command;
+	int toklen;
+
+	command = cmd_lookup(mesg, &toklen);
+	sink += text_response(command, mesg, toklen, sendmesg, sizeof(sendmesg));
+}
+
+static void case_push_keyframe(int i)
+{
+	tp_value_t values[MAX_PUSH_TAGS];
+	int count;
+
+	count = push_snapshot(values);
+	sink += push_serialize(bench_session, values, count, 0xFFFFFFFF, i, push_frames);
+}
+
+// Half the values move past their deadband each round
+static void case_push_changes(int i)
+{
+	tp_value_t values[MAX_PUSH_TAGS];
+	int count;
+
+	distance += (i & 1) ? 0.2f : -0.2f;
+	run_count++;
+	count = push_snapshot(values);
+	sink += push_serialize(bench_session, values, count, 0, i, push_frames);
+}
+
+// One tick of the wheel, with rates from a second to an hour
+static void case_wheel_tick(int i)
+{
+	wheel_timer_t* timer;
+	subscription_t* sub;
+
+	timer = wheel_advance(&bench_wheel, bench_wheel.now + 1);
+	while (timer != NULL)
+	{
+		sub = (subscription_t*)timer;
+		timer = timer->next;
+		wheel_add(&bench_wheel, &sub->timer, sub->timer.expires + sub->rate_s);
+		sink++;
+	}
+}
+
+static void wheel_setup(void)
+{
+	static const unsigned int rates[] = { 1, 2, 5, 10, 30, 60, 300, 3600 };
+	int i;
+
+	wheel_init(&bench_wheel, 0);
+	for (i = 0; i < (MAX_SESSIONS * MAX_PUSH_TAGS); i++)
+	{
+		bench_subs[i].rate_s = rates[i % 8];
+		wheel_add(&bench_wheel, &bench_subs[i].timer, 1 + (i % bench_subs[i].rate_s));
+	}
+}
+
+/*
+ *********************************************************************************
+ * harness
+ *********************************************************************************
+ */
+
+static void bench_run(const char* name, bench_case_t run)
+{
+	uint64_t start, elapsed;
+	int i, n;
+
+	for (i = 0; i < 1000; i++) // warm up
+		run(i);
+
+	n = 1000;
+	for (;;)
+	{
+		start = timing_us();
+		for (i = 0; i < n; i++)
+			run(i);
+		elapsed = timing_us() - start;
+		if (elapsed >= BENCH_MIN_US)
+			break;
+		n *= 2;
+	}
+
+	printf("%-22s %10d ops %9.1f ns/op\n", name, n, (elapsed * 1000.0) / n);
+}
+
+int main(void)
+{
+	struct sockaddr_in addr;
+
+	log_level = LOG_LEVEL_ERROR;
+	timing_init();
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)); // any free port, nothing is received
+
+	if (tp_handle_requests(bench_commands, &lock) || tp_handle_data_push(bench_pushlist, &lock))
+	{
+		printf("Error - transport setup failed\n");
+		return 1;
+	}
+	tp_stop_handlers();
+	bench_session = session_get(&addr, now_us()); // serialized for, never sent to
+
+	printf("Clock: %s\n", timing_source());
+	bench_run("cmd_lookup", case_lookup);
+	bench_run("value_format integer", case_format_integer);
+	bench_run("value_format float", case_format_float);
+	bench_run("text_response", case_text_response);
+	session_pair(bench_session, 1);
+	bench_run("push keyframe text", case_push_keyframe);
+	bench_run("push changes text", case_push_changes);
+	session_pair(bench_session, TP_PAIR_BINARY);
+	bench_run("push keyframe binary", case_push_keyframe);
+	bench_run("push changes binary", case_push_changes);
+	wheel_setup();
+	bench_run("wheel tick", case_wheel_tick);
+
+	close(sockfd);
+	return 0;
+}
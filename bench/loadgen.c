@@ -0,0 +1,270 @@
+/*
+ * loadgen.c:
+ *      Loopback load generator for the sump request handler
+ *
+ *	Each simulated client is a thread with its own socket that sends a
+ *	request, waits for the answer (or the timeout), and sends the next,
+ *	cycling through a list of commands. At the end it reports the
+ *	throughput, the latency percentiles and the share of requests that
+ *	got no answer. Run it against sump_sim:
+ *
+ *	./sump_sim &
+ *	bench/loadgen -c 16 -d 10 -m GETDISTANCE,GETTEMP,SETLOGLEVEL=2
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../timing.h"
+
+#define MAX_CLIENTS 256
+#define MAX_MIX 32
+#define MESG_MAX 1473 // PUSH_MTU + 1
+#define DEFAULT_MIX "GETDISTANCE,GETTEMP,GETHUMIDITY,SETLOGLEVEL=2"
+
+typedef struct
+{
+	const char* request; // "GETDISTANCE"
+	int len;
+	char expect[24];     // "DISTANCE=", the start of the answer
+	int expect_len;
+} mix_t;
+
+typedef struct
+{
+	pthread_t thread;
+	int index;
+	uint32_t* latency; // histogram, one bucket per microsecond up to the timeout
+	unsigned long sent;
+	unsigned long answered;
+	unsigned long dropped;
+} client_t;
+
+static struct sockaddr_in target;
+static mix_t mix[MAX_MIX];
+static int mix_count;
+static int timeout_ms = 100;
+static int buckets;
+static volatile int running = 1;
+
+/*
+ *********************************************************************************
+ * support functions
+ *********************************************************************************
+ */
+
+// The answer to GETX or SETX starts with "X=", anything else is taken as is
+static void mix_add(char* request)
+{
+	const char* tag = request;
+	mix_t* m = &mix[mix_count++];
+
+	m->request = request;
+	m->len = strlen(request);
+	if ((strncmp(request, "GET", 3) == 0) || (strncmp(request, "SET", 3) == 0))
+		tag += 3;
+	m->expect_len = snprintf(m->expect, sizeof(m->expect), "%.*s=", (int)strcspn(tag, "="), tag);
+}
+
+// Wait for the answer to m, skipping late answers to earlier requests. Returns 0 on a timeout.
+static int await(int fd, mix_t* m, uint64_t deadline)
+{
+	struct pollfd pfd;
+	char mesg[MESG_MAX];
+	uint64_t now;
+	int n;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;)
+	{
+		now = timing_us();
+		if (now >= deadline)
+			return 0;
+		if (poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) <= 0)
+			continue;
+
+		n = recv(fd, mesg, sizeof(mesg), 0);
+		if ((n >= m->expect_len) && (memcmp(mesg, m->expect, m->expect_len) == 0))
+			return 1;
+	}
+}
+
+static void* client_thread(void* ptr)
+{
+	client_t* client = ptr;
+	uint64_t start, elapsed;
+	char mesg[MESG_MAX];
+	mix_t* m;
+	int fd, i, len;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((fd < 0) || connect(fd, (struct sockaddr*)&target, sizeof(target)))
+	{
+		printf("Error - client socket: %i\n", errno);
+		return NULL;
+	}
+
+	for (i = client->index % mix_count; running; i = (i + 1) % mix_count)
+	{
+		m = &mix[i];
+		memcpy(mesg, m->request, m->len);
+		len = m->len;
+		mesg[len++] = '\r';
+		mesg[len++] = '\n';
+
+		start = timing_us();
+		if (send(fd, mesg, len, 0) != len)
+			continue;
+		client->sent++;
+
+		if (await(fd, m, start + (timeout_ms * 1000ULL)))
+		{
+			elapsed = timing_us() - start;
+			client->latency[(elapsed < (uint64_t)buckets) ? elapsed : (uint64_t)buckets - 1]++;
+			client->answered++;
+		}
+		else
+			client->dropped++;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static unsigned int percentile(const uint64_t* total, uint64_t count, double fraction)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	rank = (uint64_t)(count * fraction);
+	for (i = 0; i < buckets; i++)
+	{
+		seen += total[i];
+		if (seen > rank)
+			return i;
+	}
+
+	return buckets - 1;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [-h host] [-p port] [-c clients] [-d seconds] [-t timeout_ms] [-m CMD,CMD,...]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+	client_t* clients;
+	uint64_t* total;
+	uint64_t start, elapsed, sent = 0, answered = 0, dropped = 0;
+	const char* host = "127.0.0.1";
+	char* mixlist = NULL;
+	char* token;
+	int port = 32001, nclients = 16, seconds = 10;
+	int opt, c, i;
+
+	while ((opt = getopt(argc, argv, "h:p:c:d:t:m:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'c': nclients = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 't': timeout_ms = atoi(optarg); break;
+		case 'm': mixlist = optarg; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if ((nclients < 1) || (nclients > MAX_CLIENTS) || (seconds < 1) || (timeout_ms < 1))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	mixlist = strdup((mixlist != NULL) ? mixlist : DEFAULT_MIX);
+	for (token = strtok(mixlist, ","); (token != NULL) && (mix_count < MAX_MIX); token = strtok(NULL, ","))
+		mix_add(token);
+	if (mix_count == 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &target.sin_addr) != 1)
+	{
+		printf("Error - bad host %s\n", host);
+		return 1;
+	}
+
+	timing_init();
+	buckets = (timeout_ms * 1000) + 1;
+	clients = calloc(nclients, sizeof(client_t));
+	total = calloc(buckets, sizeof(uint64_t));
+	for (c = 0; c < nclients; c++)
+	{
+		clients[c].index = c;
+		clients[c].latency = calloc(buckets, sizeof(uint32_t));
+	}
+
+	start = timing_us();
+	for (c = 0; c < nclients; c++)
+		pthread_create(&clients[c].thread, NULL, client_thread, &clients[c]);
+	sleep(seconds);
+	running = 0;
+	for (c = 0; c < nclients; c++)
+		pthread_join(clients[c].thread, NULL);
+	elapsed = timing_us() - start;
+
+	for (c = 0; c < nclients; c++)
+	{
+		sent += clients[c].sent;
+		answered += clients[c].answered;
+		dropped += clients[c].dropped;
+		for (i = 0; i < buckets; i++)
+			total[i] += clients[c].latency[i];
+	}
+
+	printf("%d clients, %.1f s, %d commands\n", nclients, elapsed / 1e6, mix_count);
+	printf("sent %lu, answered %lu, dropped %lu (%.3f%%)\n",
+	       (unsigned long)sent, (unsigned long)answered, (unsigned long)dropped,
+	       sent ? (dropped * 100.0) / sent : 0.0);
+	printf("throughput %.0f requests/s\n", (answered * 1e6) / elapsed);
+	if (answered)
+		printf("latency us p50 %u, p99 %u, p999 %u\n", percentile(total, answered, 0.50),
+		       percentile(total, answered, 0.99), percentile(total, answered, 0.999));
+
+	return 0;
+}
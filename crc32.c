@@ -0,0 +1,58 @@
+/*
+ * crc32.c:
+ *      CRC-32 (IEEE 802.3, as used by zlib and ethernet)
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "crc32.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		crc_table[i] = c;
+	}
+}
+
+uint32_t crc32(uint32_t crc, const void* buf, size_t len)
+{
+	const unsigned char* p = buf;
+
+	pthread_once(&crc_once, crc32_init);
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
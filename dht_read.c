@@ -1,135 +1,224 @@
 
 
-
-#include <wiringPi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <sched.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "hal.h"
+#include "dht_read.h"
 
-#define MAX_TIME 85
 #define DTTYPE 22 // AM2302 is the same as DHT22
-
-int dhtpin;
-
-int data_val[5] = {0, 0, 0, 0, 0};
-
-void set_max_priority(void)
+#define FRAME_EDGES 84
+#define FRAME_TIMEOUT_US 10000 // a full frame takes about 5ms
+#define ONE_THRESHOLD_US 48 // high pulse is 26-28us for a 0, 70us for a 1
+#define MAX_RETRIES 2
+#define RETRY_DELAY_MS 2000 // DHT22 needs 2 seconds between reads
+
+static dht_t dht_default; // the dht_init, dht_read_val and dht_get_stats instance
+
+/*
+ * Record each edge with its timestamp, the frame is decoded after it ends
+ */
+static void dht_edge(void* context, int level, unsigned int timestamp)
 {
-	struct sched_param sched;
-	memset(&sched, 0, sizeof(sched));
-	// Use FIFO scheduler with highest priority for the lowest chance of the kernel context switching.
-	sched.sched_priority = sched_get_priority_max(SCHED_FIFO);
-	sched_setscheduler(0, SCHED_FIFO, &sched);
-}
+	dht_t* dht = context;
 
-void set_default_priority(void)
-{
-	struct sched_param sched;
-	memset(&sched, 0, sizeof(sched));
-	// Go back to default scheduler with default 0 priority.
-	sched.sched_priority = 0;
-	sched_setscheduler(0, SCHED_OTHER, &sched);
+	pthread_mutex_lock(&dht->lock);
+	if (dht->capturing && (dht->edge_count < DHT_MAX_EDGES))
+	{
+		dht->edge_time[dht->edge_count] = timestamp;
+		dht->edge_level[dht->edge_count] = level;
+		dht->edge_count++;
+		if (dht->edge_count >= FRAME_EDGES)
+			pthread_cond_signal(&dht->cond);
+	}
+	pthread_mutex_unlock(&dht->lock);
 }
 
-static uint8_t sizecvt(const int read)
+/*
+ * Classify the bits by high pulse width. The frame ends with the 40 data
+ * pulses, so the last 40 complete high pulses are the data, whatever
+ * came before them (response pulse, or edges missed at the start).
+ */
+static int dht_decode(dht_t* dht)
 {
-  /* digitalRead() and friends from wiringpi are defined as returning a value
-  < 256. However, they are returned as int() types. This is a safety function */
+	unsigned int width[DHT_MAX_EDGES];
+	unsigned int risetime = 0;
+	int rising = 0;
+	int i, n, first;
 
-	if (read > 255 || read < 0)
+	n = 0;
+	for (i = 0; i < dht->edge_count; i++)
 	{
-		printf("Invalid data from wiringPi library\n");
-		exit(EXIT_FAILURE);
+		if (dht->edge_level[i] == HAL_HIGH)
+		{
+			risetime = dht->edge_time[i];
+			rising = 1;
+		}
+		else if (rising)
+		{
+			width[n++] = dht->edge_time[i] - risetime;
+			rising = 0;
+		}
 	}
-	return (uint8_t)read;
-}
 
-int dht_read_val(float* farenheit, float* celsius, float* humidity)
-{
-	uint8_t laststate = HIGH;
-	uint8_t counter = 0;
-	uint8_t j = 0, i;
-
-	data_val[0] = data_val[1] = data_val[2] = data_val[3] = data_val[4] = 0;
+	if (n < 40)
+		return -1;
 
-	set_max_priority();
+	memset(dht->data, 0, sizeof(dht->data));
+	first = n - 40;
+	for (i = 0; i < 40; i++)
+	{
+		dht->data[i / 8] <<= 1;
+		if (width[first + i] > ONE_THRESHOLD_US)
+			dht->data[i / 8] |= 1;
+	}
 
-	// pull pin down for 18 milliseconds
-	pinMode(dhtpin, OUTPUT);
-	digitalWrite(dhtpin, HIGH);
-	delay(10);
-	digitalWrite(dhtpin, LOW);
-	delay(18);
+	return 0;
+}
 
-	// then pull it up for 40 microseconds
-	digitalWrite(dhtpin, HIGH);
-	delayMicroseconds(40);
+// Returns 0, -1 if the frame was incomplete or -2 on a checksum error
+static int dht_read_once(dht_t* dht, float* farenheit, float* celsius, float* humidity)
+{
+	struct timespec deadline;
+	int* data_val = dht->data;
+	int err;
 
-	// prepare to read pin
-	pinMode(dhtpin, INPUT);
+	// pull pin down for 18 milliseconds
+	hal_pin_mode(dht->pin, HAL_OUTPUT);
+	hal_digital_write(dht->pin, HAL_HIGH);
+	hal_delay_ms(10);
+	hal_digital_write(dht->pin, HAL_LOW);
+	hal_delay_ms(18);
+
+	// then release it, and record the edges of the response
+	pthread_mutex_lock(&dht->lock);
+	dht->edge_count = 0;
+	dht->capturing = 1;
+	pthread_mutex_unlock(&dht->lock);
+
+	hal_digital_write(dht->pin, HAL_HIGH);
+	hal_pin_mode(dht->pin, HAL_INPUT);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += FRAME_TIMEOUT_US * 1000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
 
-	for (i = 0; i < MAX_TIME; i++)
+	pthread_mutex_lock(&dht->lock);
+	while (dht->edge_count < FRAME_EDGES)
 	{
-		counter = 0;
-		while (sizecvt(digitalRead(dhtpin)) == laststate)
-		{
-			counter++;
-			delayMicroseconds(1);
-			if (counter == 255)
-				break;
-		}
-		laststate = sizecvt(digitalRead(dhtpin));
-		if (counter == 255)
+		if (pthread_cond_timedwait(&dht->cond, &dht->lock, &deadline) == ETIMEDOUT)
 			break;
+	}
+	dht->capturing = 0;
+	err = dht_decode(dht);
+	pthread_mutex_unlock(&dht->lock);
 
-		// top 3 transistions are ignored
-		if ( (i >= 4) && (i%2 == 0) )
-		{
-			data_val[j/8] <<= 1;
-			if (counter > 16)
-				data_val[j/8] |= 1;
-			j++;
-		}
-	} // verify cheksum and print the verified data
+	// verify cheksum and print the verified data
+	if (err)
+		return -1;
+	else if ( (data_val[4] != ( (data_val[0] + data_val[1] + data_val[2] + data_val[3]) & 0xFF) ) ||
+		((data_val[0] | data_val[1] | data_val[2] | data_val[3]) == 0) ) // a checksum of 0 is valid, an all 0 frame is not
+		return -2;
 
-	set_default_priority();
+	if (DTTYPE == 11)
+	{
+		*humidity = (float)data_val[0] + ((float)data_val[1] / 10.0f);
+		*celsius = (float)data_val[2] + ((float)data_val[2] / 10.0f);
+	}
+	else // (DTTYPE == 22)
+	{
+		// Calculate humidity and temp for DHT22 sensor.
+		*humidity = ((float)data_val[0] * 256.0f + (float)data_val[1]) / 10.0f;
+		*celsius = ( (float)(data_val[2] & 0x7F) * 256.0f + (float)data_val[3]) / 10.0f;
+		if (data_val[2] & 0x80)
+			*celsius *= -1.0f;
+	}
+	*farenheit = ((*celsius * 9.0f) / 5.0f) + 32.0f;
+	return 0;
+}
+
+int dht_read(dht_t* dht, float* farenheit, float* celsius, float* humidity)
+{
+	int attempt, err = -1;
 
-	if ( (j >= 40) &&
-		(data_val[4] == ( (data_val[0] + data_val[1] + data_val[2] + data_val[3]) & 0xFF) ) &&
-		(data_val[4] != 0)
-	   )
+	for (attempt = 0; (attempt <= MAX_RETRIES) && err; attempt++)
 	{
-		if (DTTYPE == 11)
-		{
-			*humidity = (float)data_val[0] + ((float)data_val[1] / 10.0f);
-			*celsius = (float)data_val[2] + ((float)data_val[2] / 10.0f);
-		}
-		else // (DTTYPE == 22)
-		{
-			// Calculate humidity and temp for DHT22 sensor.
-			*humidity = ((float)data_val[0] * 256.0f + (float)data_val[1]) / 10.0f;
-			*celsius = ( (float)(data_val[2] & 0x7F) * 256.0f + (float)data_val[3]) / 10.0f;
-			if (data_val[2] & 0x80)
-				*celsius *= -1.0f;
-		}
-		*farenheit = ((*celsius * 9.0f) / 5.0f) + 32.0f;
-		return 0;
+		if (attempt)
+			hal_delay_ms(RETRY_DELAY_MS);
+
+		err = dht_read_once(dht, farenheit, celsius, humidity);
+
+		pthread_mutex_lock(&dht->lock);
+		dht->stats.reads++;
+		if (attempt)
+			dht->stats.retries++;
+		if (err == 0)
+			dht->stats.good++;
+		else if (err == -1)
+			dht->stats.timeouts++;
+		else
+			dht->stats.checksum_errors++;
+		pthread_mutex_unlock(&dht->lock);
 	}
-	else
+
+	if (err)
+	{
+		pthread_mutex_lock(&dht->lock);
+		dht->stats.failures++;
+		pthread_mutex_unlock(&dht->lock);
 		return -1;
+	}
+
+	return 0;
 }
 
-int dht_init(int pin)
+void dht_stats(dht_t* dht, dht_stats_t* s)
+{
+	pthread_mutex_lock(&dht->lock);
+	*s = dht->stats;
+	pthread_mutex_unlock(&dht->lock);
+}
+
+int dht_open(dht_t* dht, int pin)
 {
-	dhtpin = pin;
-	
-	pinMode(dhtpin, INPUT); // set as high impedance
+	pthread_condattr_t attr;
+
+	memset(dht, 0, sizeof(dht_t));
+	dht->pin = pin;
+
+	pthread_mutex_init(&dht->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dht->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	hal_pin_mode(dht->pin, HAL_INPUT); // set as high impedance
+	hal_isr_ts(dht->pin, HAL_EDGE_BOTH, &dht_edge, dht);
 
 	return 0;
 }
 
+int dht_read_val(float* farenheit, float* celsius, float* humidity)
+{
+	return dht_read(&dht_default, farenheit, celsius, humidity);
+}
+
+void dht_get_stats(dht_stats_t* s)
+{
+	dht_stats(&dht_default, s);
+}
 
+int dht_init(int pin)
+{
+	return dht_open(&dht_default, pin);
+}
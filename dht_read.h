@@ -1,5 +1,42 @@
 
+#ifndef DHT_READ_H
+#define DHT_READ_H
+
+#include <pthread.h>
+
+#define DHT_MAX_EDGES 100 // a full frame is 84 edges
+
+typedef struct
+{
+	unsigned int reads;           // attempts, including retries
+	unsigned int good;
+	unsigned int retries;
+	unsigned int timeouts;        // frame incomplete, edges missing
+	unsigned int checksum_errors;
+	unsigned int failures;        // dht_read_val calls that gave up
+} dht_stats_t;
+
+// One DHT22, its edge callback gets the instance as context
+typedef struct
+{
+	int pin;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int capturing;
+	int edge_count;
+	unsigned int edge_time[DHT_MAX_EDGES];
+	unsigned char edge_level[DHT_MAX_EDGES];
+	int data[5];
+	dht_stats_t stats;
+} dht_t;
+
+int dht_open(dht_t* dht, int pin);
+int dht_read(dht_t* dht, float* farenheit, float* celsius, float* humidity);
+void dht_stats(dht_t* dht, dht_stats_t* stats);
+
+// The same on a single built-in instance
 int dht_read_val(float* farenheit, float* celsius, float* humidity);
 int dht_init(int pin);
+void dht_get_stats(dht_stats_t* stats);
 
-
+#endif
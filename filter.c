@@ -0,0 +1,149 @@
+/*
+ * filter.c:
+ *      Robust estimators for a burst of sensor readings
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stddef.h>
+#include "filter.h"
+
+#define HAMPEL_SIGMAS 3.0
+#define MAD_TO_SIGMA 1.4826 // MAD of normally distributed readings is 0.6745 sigma
+
+/*
+ *********************************************************************************
+ * support functions
+ *********************************************************************************
+ */
+
+static double median_of(const double* sorted, int count)
+{
+	if (count & 1)
+		return sorted[count / 2];
+	return (sorted[(count / 2) - 1] + sorted[count / 2]) / 2.0;
+}
+
+// Median absolute deviation from median, count > 0
+static double mad_of(const double* sorted, int count, double median)
+{
+	double dev[FILTER_MAX_COUNT];
+	double d;
+	int i, j;
+
+	// Insertion sort, there are only a few readings
+	for (i = 0; i < count; i++)
+	{
+		d = sorted[i] - median;
+		if (d < 0)
+			d = -d;
+		for (j = i; (j > 0) && (dev[j - 1] > d); j--)
+			dev[j] = dev[j - 1];
+		dev[j] = d;
+	}
+
+	return median_of(dev, count);
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+void filter_init(filter_t* filter, int kind, int min_count, double tolerance)
+{
+	filter->kind = kind;
+	filter->min_count = min_count;
+	filter->tolerance = tolerance;
+	filter->count = 0;
+}
+
+void filter_reset(filter_t* filter)
+{
+	filter->count = 0;
+}
+
+int filter_add(filter_t* filter, double value)
+{
+	int i;
+
+	if (filter->count >= FILTER_MAX_COUNT)
+		return -1;
+
+	for (i = filter->count; (i > 0) && (filter->sorted[i - 1] > value); i--)
+		filter->sorted[i] = filter->sorted[i - 1];
+	filter->sorted[i] = value;
+	filter->count++;
+
+	return 0;
+}
+
+int filter_estimate(filter_t* filter, double* estimate)
+{
+	double median, limit, sum;
+	int i, n, trim;
+
+	if (filter->count == 0)
+		return -1;
+
+	median = median_of(filter->sorted, filter->count);
+	switch (filter->kind)
+	{
+		case FILTER_TRIMMED_MEAN:
+			trim = (filter->count + 1) / 4;
+			sum = 0;
+			for (i = trim; i < (filter->count - trim); i++)
+				sum += filter->sorted[i];
+			*estimate = sum / (filter->count - (2 * trim));
+			break;
+		case FILTER_HAMPEL:
+			limit = HAMPEL_SIGMAS * MAD_TO_SIGMA * mad_of(filter->sorted, filter->count, median);
+			sum = 0;
+			n = 0;
+			for (i = 0; i < filter->count; i++)
+			{
+				if ((filter->sorted[i] >= (median - limit)) && (filter->sorted[i] <= (median + limit)))
+				{
+					sum += filter->sorted[i];
+					n++;
+				}
+			}
+			*estimate = sum / n; // the median itself is always within the limit
+			break;
+		case FILTER_MEDIAN:
+		default:
+			*estimate = median;
+			break;
+	}
+
+	return 0;
+}
+
+int filter_converged(filter_t* filter)
+{
+	double median;
+
+	if ((filter->count == 0) || (filter->count < filter->min_count))
+		return 0;
+
+	median = median_of(filter->sorted, filter->count);
+	return mad_of(filter->sorted, filter->count, median) <= filter->tolerance;
+}
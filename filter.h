@@ -0,0 +1,64 @@
+/*
+ * filter.h:
+ *      Robust estimators for a burst of sensor readings
+ *
+ *	Readings are added one at a time to a filter_t, which keeps them
+ *	sorted in a fixed buffer, so nothing is allocated while measuring.
+ *	The estimate is one of:
+ *
+ *	FILTER_MEDIAN        the middle reading
+ *	FILTER_TRIMMED_MEAN  mean of about the middle half
+ *	FILTER_HAMPEL        mean of the readings within 3 scaled MADs
+ *	                     (median absolute deviations) of the median
+ *
+ *	A burst can stop early once the readings agree: filter_converged is
+ *	true when at least min_count readings are in and their MAD is within
+ *	the tolerance.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#define FILTER_MEDIAN 0
+#define FILTER_TRIMMED_MEAN 1
+#define FILTER_HAMPEL 2
+
+#define FILTER_MAX_COUNT 32
+
+typedef struct
+{
+	int kind;
+	int min_count;
+	double tolerance;
+	int count;
+	double sorted[FILTER_MAX_COUNT];
+} filter_t;
+
+void filter_init(filter_t* filter, int kind, int min_count, double tolerance);
+void filter_reset(filter_t* filter);
+// Returns -1 if the buffer is full
+int filter_add(filter_t* filter, double value);
+// Returns -1 if there are no readings
+int filter_estimate(filter_t* filter, double* estimate);
+int filter_converged(filter_t* filter);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * fmt.c:
+ *      Allocation-free number formatting for the transport
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "fmt.h"
+
+#define FIXED1_MAX 1000000.0f // tenths stay exact in a float mantissa below this
+
+int fmt_uint(char* out, unsigned int value)
+{
+	char digits[FMT_UINT_LEN];
+	int n = FMT_UINT_LEN;
+
+	do
+	{
+		digits[--n] = '0' + (value % 10);
+		value /= 10;
+	}
+	while (value != 0);
+
+	memcpy(out, &digits[n], FMT_UINT_LEN - n);
+	return FMT_UINT_LEN - n;
+}
+
+/*
+ * The float is mantissa * 2^exponent exactly, so the tenths come from an
+ * integer multiply and shift, rounded half to even on the exact value
+ * the way printf does, without any float arithmetic.
+ */
+int fmt_fixed1(char* out, float value)
+{
+	union { float f; uint32_t u; } bits;
+	uint64_t scaled, rem, half;
+	uint32_t mantissa, tenths;
+	int exponent, len = 0;
+
+	// NaN, infinity and huge values are rare enough for printf
+	if (!((value > -FIXED1_MAX) && (value < FIXED1_MAX)))
+		return snprintf(out, FMT_FIXED1_LEN, "%.1f", value);
+
+	bits.f = value;
+	exponent = (bits.u >> 23) & 0xFF;
+	mantissa = bits.u & 0x7FFFFF;
+	if (exponent != 0)
+		mantissa |= 0x800000;
+	else
+		exponent = 1; // subnormal
+	exponent = 150 - exponent; // value = mantissa / 2^exponent, exponent > 0 below FIXED1_MAX
+
+	scaled = (uint64_t)mantissa * 10;
+	if (exponent > 40)
+		tenths = 0; // below 2^-16
+	else
+	{
+		tenths = scaled >> exponent;
+		rem = scaled & ((1ULL << exponent) - 1);
+		half = 1ULL << (exponent - 1);
+		if ((rem > half) || ((rem == half) && (tenths & 1)))
+			tenths++;
+	}
+
+	if (bits.u >> 31)
+		out[len++] = '-';
+	len += fmt_uint(&out[len], tenths / 10);
+	out[len++] = '.';
+	out[len++] = '0' + (tenths % 10);
+
+	return len;
+}
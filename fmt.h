@@ -0,0 +1,40 @@
+/*
+ * fmt.h:
+ *      Allocation-free number formatting for the transport
+ *
+ *	The same text printf("%u") and printf("%.1f") give, built with
+ *	integer arithmetic only. Each function writes no terminator and
+ *	returns the exact length written, so messages are assembled by
+ *	appending.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef FMT_H
+#define FMT_H
+
+#define FMT_UINT_LEN 10  // longest fmt_uint
+#define FMT_FIXED1_LEN 48 // "-" and 39 digits of FLT_MAX, ".0", terminator
+
+int fmt_uint(char* out, unsigned int value);
+// One decimal, exactly as printf("%.1f")
+int fmt_fixed1(char* out, float value);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * frame.c:
+ *      Binary framing for the transport
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "crc32.h"
+#include "seqlock.h"
+#include "transport.h"
+#include "frame.h"
+
+#define ENTRY_HEADER_LEN 2
+#define STRING_MAX 0xFFFF
+
+static void put_u32(unsigned char* p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static uint32_t get_u32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ *********************************************************************************
+ * writing
+ *********************************************************************************
+ */
+
+void frame_begin(frame_t* frame, void* buf, int size, frame_kind_e kind, unsigned int sequence)
+{
+	frame->buf = buf;
+	frame->size = size - FRAME_CRC_LEN;
+	frame->count = 0;
+	frame->buf[0] = FRAME_MAGIC;
+	frame->buf[1] = FRAME_VERSION;
+	frame->buf[2] = kind;
+	frame->buf[3] = 0;
+	put_u32(&frame->buf[4], sequence);
+	frame->len = FRAME_HEADER_LEN;
+}
+
+int frame_put(frame_t* frame, unsigned int id, data_type_e type, const void* value)
+{
+	unsigned char* p = &frame->buf[frame->len];
+	union { float f; uint32_t u; } bits;
+	int n = 0;
+
+	if (frame->count == 0xFF)
+		return -1;
+
+	switch (type)
+	{
+		case TYPE_INTEGER:
+		case TYPE_FLOAT:
+			n = 4;
+			break;
+		case TYPE_STRING:
+			n = strnlen((const char*)value, STRING_MAX);
+			if ((frame->len + ENTRY_HEADER_LEN + 2 + n) > frame->size)
+				return -1;
+			p[2] = n;
+			p[3] = n >> 8;
+			memcpy(&p[4], value, n);
+			n += 2;
+			break;
+		case TYPE_NULL:
+		case TYPE_LINES: // only a command's answer, never put
+			break;
+	}
+	if ((frame->len + ENTRY_HEADER_LEN + n) > frame->size)
+		return -1;
+
+	p[0] = id;
+	p[1] = type;
+	if (type == TYPE_INTEGER)
+		put_u32(&p[2], *(const unsigned int*)value);
+	else if (type == TYPE_FLOAT)
+	{
+		bits.f = *(const float*)value;
+		put_u32(&p[2], bits.u);
+	}
+
+	frame->len += ENTRY_HEADER_LEN + n;
+	frame->count++;
+	return 0;
+}
+
+int frame_end(frame_t* frame)
+{
+	frame->buf[3] = frame->count;
+	put_u32(&frame->buf[frame->len], crc32(0, frame->buf, frame->len));
+	return frame->len + FRAME_CRC_LEN;
+}
+
+/*
+ *********************************************************************************
+ * reading
+ *********************************************************************************
+ */
+
+int frame_open(frame_reader_t* reader, const void* buf, int len, unsigned int* sequence)
+{
+	const unsigned char* p = buf;
+
+	if ((len < (FRAME_HEADER_LEN + FRAME_CRC_LEN)) || (p[0] != FRAME_MAGIC) || (p[1] != FRAME_VERSION))
+		return -1;
+	len -= FRAME_CRC_LEN;
+	if (crc32(0, p, len) != get_u32(&p[len]))
+		return -1;
+
+	reader->buf = p;
+	reader->len = len;
+	reader->pos = FRAME_HEADER_LEN;
+	reader->count = p[3];
+	*sequence = get_u32(&p[4]);
+	return p[2];
+}
+
+int frame_next(frame_reader_t* reader, frame_entry_t* entry)
+{
+	const unsigned char* p = &reader->buf[reader->pos];
+	int left = reader->len - reader->pos;
+	union { float f; uint32_t u; } bits;
+	int n = 0;
+
+	if (reader->count == 0)
+		return 1;
+	if (left < ENTRY_HEADER_LEN)
+		return -1;
+
+	entry->id = p[0];
+	entry->type = p[1];
+	switch (p[1])
+	{
+		case TYPE_INTEGER:
+		case TYPE_FLOAT:
+			n = 4;
+			if (left < (ENTRY_HEADER_LEN + n))
+				return -1;
+			entry->u = get_u32(&p[2]);
+			bits.u = entry->u;
+			entry->f = bits.f;
+			break;
+		case TYPE_STRING:
+			if (left < (ENTRY_HEADER_LEN + 2))
+				return -1;
+			entry->slen = p[2] | (p[3] << 8);
+			n = 2 + entry->slen;
+			if (left < (ENTRY_HEADER_LEN + n))
+				return -1;
+			entry->s = (const char*)&p[4];
+			break;
+		case TYPE_NULL:
+			break;
+		default:
+			return -1;
+	}
+
+	reader->pos += ENTRY_HEADER_LEN + n;
+	reader->count--;
+	return 0;
+}
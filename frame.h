@@ -0,0 +1,94 @@
+/*
+ * frame.h:
+ *      Binary framing for the transport
+ *
+ *	An alternative to the "TAG=value\r\n" strings for clients that talk
+ *	to the daemon at high rates. A client asks for it with PAIR 2, the
+ *	RTI processor keeps the text. All integers are little-endian.
+ *
+ *	header   magic 0xB5, version 1, kind, entry count (1 byte each),
+ *	         sequence (4 bytes): the push sequence number, or an id the
+ *	         client chose for a request, echoed in the response
+ *	entries  id, type (1 byte each), then the value: 4 byte unsigned,
+ *	         4 byte IEEE float, or a 2 byte length and that many bytes
+ *	         of string. Type 0 has no value, in a request it reads the
+ *	         command, in a response the command is unknown.
+ *	trailer  CRC-32 of everything before it (4 bytes)
+ *
+ *	The id is fixed per command by the id column of the command tables
+ *	(GETIDS lists them), pushes use the id of the command with the same tag.
+ *	The type codes are the data_type_e values.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#define FRAME_MAGIC 0xB5 // not ASCII, so no text command starts with it
+#define FRAME_VERSION 1
+#define FRAME_HEADER_LEN 8
+#define FRAME_CRC_LEN 4
+
+typedef enum
+{
+	FRAME_REQUEST = 1,
+	FRAME_RESPONSE,
+	FRAME_PUSH
+} frame_kind_e;
+
+typedef struct
+{
+	unsigned char* buf;
+	int size;
+	int len;
+	int count;
+} frame_t;
+
+typedef struct
+{
+	const unsigned char* buf;
+	int len;   // without the trailer
+	int pos;
+	int count; // entries left
+} frame_reader_t;
+
+typedef struct
+{
+	unsigned int id;
+	data_type_e type;
+	unsigned int u;
+	float f;
+	const char* s; // not terminated
+	int slen;
+} frame_entry_t;
+
+void frame_begin(frame_t* frame, void* buf, int size, frame_kind_e kind, unsigned int sequence);
+// value points to an unsigned int, a float or a string, by type. Returns -1 if it does not fit.
+int frame_put(frame_t* frame, unsigned int id, data_type_e type, const void* value);
+// Fill in the count and the CRC, returns the frame length
+int frame_end(frame_t* frame);
+
+// Check the header and CRC, returns the kind, or -1 if buf is not a valid frame
+int frame_open(frame_reader_t* reader, const void* buf, int len, unsigned int* sequence);
+// Returns 0 with the next entry, 1 after the last, or -1 if the frame is malformed
+int frame_next(frame_reader_t* reader, frame_entry_t* entry);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * hal.c:
+ *      Backend selection for the GPIO/timer abstraction
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "hal.h"
+#include "log.h"
+
+const hal_backend_t* hal = NULL;
+
+int hal_setup(const hal_backend_t* backend)
+{
+	char* env;
+
+	if (backend == NULL)
+	{
+#ifdef HAL_NO_WIRINGPI
+		backend = &hal_sim_backend;
+#else
+		backend = &hal_wiringpi_backend;
+#endif
+		env = getenv("SUMP_HAL");
+		if ((env != NULL) && (strcmp(env, "sim") == 0))
+			backend = &hal_sim_backend;
+#ifndef HAL_NO_WIRINGPI
+		else if ((env != NULL) && (strcmp(env, "wiringpi") == 0))
+			backend = &hal_wiringpi_backend;
+#endif
+	}
+
+	hal = backend;
+	log_info("HAL backend: %s", hal->name);
+
+	return hal->setup();
+}
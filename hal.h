@@ -0,0 +1,108 @@
+/*
+ * hal.h:
+ *      GPIO and timer abstraction used by the sensor drivers
+ *
+ *	The drivers (beep.c, dht_read.c, range.c) call through the selected
+ *	backend instead of calling wiringPi directly. hal_wiringpi.c talks to
+ *	the real hardware, hal_sim.c simulates the sensors in-process so the
+ *	drivers can be run and profiled on an ordinary Linux box.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+// Values match wiringPi so the wiringPi backend can pass them straight through
+#define HAL_LOW 0
+#define HAL_HIGH 1
+
+#define HAL_INPUT 0
+#define HAL_OUTPUT 1
+
+#define HAL_PUD_OFF 0
+#define HAL_PUD_DOWN 1
+#define HAL_PUD_UP 2
+
+#define HAL_EDGE_SETUP 0
+#define HAL_EDGE_FALLING 1
+#define HAL_EDGE_RISING 2
+#define HAL_EDGE_BOTH 3
+
+typedef void (*hal_isr_t)(void);
+// Edge callback with the level after the edge and a microsecond timestamp of it.
+// Only differences between timestamps of the same pin are meaningful.
+typedef void (*hal_edge_t)(void* context, int level, unsigned int timestamp);
+
+typedef struct
+{
+	const char* name;
+	int (*setup)(void);
+	void (*pin_mode)(int pin, int mode);
+	void (*pull_up_dn)(int pin, int pud);
+	int (*digital_read)(int pin);
+	void (*digital_write)(int pin, int value);
+	int (*isr)(int pin, int edge, hal_isr_t function);
+	int (*isr_ts)(int pin, int edge, hal_edge_t function, void* context);
+	void (*delay_ms)(unsigned int ms);
+	void (*delay_us)(unsigned int us);
+	unsigned int (*micros)(void); // free running 32 bit microsecond counter
+} hal_backend_t;
+
+#ifndef HAL_NO_WIRINGPI
+extern const hal_backend_t hal_wiringpi_backend;
+#endif
+extern const hal_backend_t hal_sim_backend;
+
+extern const hal_backend_t* hal;
+
+/*
+ * Select and set up a backend. Pass NULL to pick the default: the SUMP_HAL
+ * environment variable ("wiringpi" or "sim") if set, otherwise wiringPi
+ * (or the simulator when built with HAL_NO_WIRINGPI).
+ */
+int hal_setup(const hal_backend_t* backend);
+
+static inline void hal_pin_mode(int pin, int mode) { hal->pin_mode(pin, mode); }
+static inline void hal_pull_up_dn(int pin, int pud) { hal->pull_up_dn(pin, pud); }
+static inline int hal_digital_read(int pin) { return hal->digital_read(pin); }
+static inline void hal_digital_write(int pin, int value) { hal->digital_write(pin, value); }
+static inline int hal_isr(int pin, int edge, hal_isr_t function) { return hal->isr(pin, edge, function); }
+static inline int hal_isr_ts(int pin, int edge, hal_edge_t function, void* context) { return hal->isr_ts(pin, edge, function, context); }
+static inline void hal_delay_ms(unsigned int ms) { hal->delay_ms(ms); }
+static inline void hal_delay_us(unsigned int us) { hal->delay_us(us); }
+static inline unsigned int hal_micros(void) { return hal->micros(); }
+
+/*
+ * Simulator controls, only meaningful when hal == &hal_sim_backend
+ */
+
+// Wire a simulated HC-SR04 to the given pins, up to 8 of them
+void hal_sim_attach_range(int echopin, int triggerpin);
+// Wire a simulated DHT22 to the given pin, up to 8 of them
+void hal_sim_attach_dht(int pin);
+// Distances (inches) returned by successive pings of any sensor, cycled. Values <= 0 give no echo.
+void hal_sim_script_distance(const float* inches, int count);
+// Temperature/humidity pairs returned by successive DHT reads, cycled
+void hal_sim_script_dht(const float* celsius, const float* humidity, int count);
+// Emulated cost of a single digitalRead, the Pi GPIO path is much slower than memory
+void hal_sim_set_read_cost(unsigned int ns);
+
+#endif
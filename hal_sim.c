@@ -0,0 +1,593 @@
+/*
+ * hal_sim.c:
+ *      Simulated GPIO/timer backend
+ *
+ *	Generates HC-SR04 echo pulses and DHT22 bit streams from scripted
+ *	values so the drivers can be run, benchmarked and regression tested
+ *	without a raspberry pi. Input pins are described by a waveform (a list
+ *	of timed edges against CLOCK_MONOTONIC), digitalRead samples the
+ *	waveform, and an event thread calls registered ISRs as edges pass.
+ *
+ *	Environment (optional, comma separated lists, cycled):
+ *      SUMP_SIM_DISTANCE  distances in inches returned by each ping
+ *      SUMP_SIM_TEMP      temperatures in celsius returned by each DHT read
+ *      SUMP_SIM_HUMIDITY  humidity in percent returned by each DHT read
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include "hal.h"
+
+#define SIM_MAX_PINS 64
+#define SIM_MAX_EDGES 100
+#define SIM_MAX_SCRIPT 64
+#define SIM_MAX_SENSORS 8 // of each kind
+
+#define SIM_ECHO_DELAY_US 450 // HC-SR04 sends its 40kHz burst before raising echo
+#define SIM_ECHO_NONE_US 38000 // HC-SR04 echo width when nothing is in range
+#define SIM_US_PER_INCH 148
+#define SIM_DHT_START_US 1000 // Minimum host low time the DHT22 accepts as a start signal
+#define SIM_DHT_DELAY_US 20
+#define SIM_DHT_RESPONSE_US 80
+#define SIM_DHT_BIT_LOW_US 50
+#define SIM_DHT_ZERO_US 27
+#define SIM_DHT_ONE_US 70
+#define SIM_READ_COST_NS 1000
+#define SIM_ISR_SPIN_US 200
+#define SIM_ISR_PRIORITY 55 // wiringPi piHiPri() level for its interrupt thread
+
+typedef struct
+{
+	int mode;
+	int out_level;
+	int idle_level;
+	hal_isr_t isr;
+	hal_edge_t edge_function;
+	void* edge_context;
+	int isr_edge;
+	uint64_t lowstart;
+	uint64_t highstart;
+	int wave_count;
+	int wave_next; // next edge to hand to the isr
+	uint64_t wave_time[SIM_MAX_EDGES];
+	uint8_t wave_level[SIM_MAX_EDGES];
+} sim_pin_t;
+
+static sim_pin_t pins[SIM_MAX_PINS];
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_cond;
+static pthread_t sim_thread;
+
+static int range_echo[SIM_MAX_SENSORS];
+static int range_trigger[SIM_MAX_SENSORS];
+static int range_count;
+static int dht_pin[SIM_MAX_SENSORS];
+static int dht_count;
+
+static float script_distance[SIM_MAX_SCRIPT] = {24.0f};
+static int script_distance_count = 1;
+static int script_distance_index;
+static float script_celsius[SIM_MAX_SCRIPT] = {20.0f};
+static float script_humidity[SIM_MAX_SCRIPT] = {45.0f};
+static int script_dht_count = 1;
+static int script_dht_index;
+static unsigned int read_cost_ns = SIM_READ_COST_NS;
+
+/*
+ *********************************************************************************
+ * support functions
+ *********************************************************************************
+ */
+
+static uint64_t sim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static uint64_t sim_now_us(void)
+{
+	return sim_now_ns() / 1000;
+}
+
+static void sim_spin_ns(uint64_t ns)
+{
+	uint64_t end = sim_now_ns() + ns;
+
+	while (sim_now_ns() < end);
+}
+
+static int sim_valid_pin(int pin)
+{
+	return ((pin >= 0) && (pin < SIM_MAX_PINS));
+}
+
+static int sim_level_at(sim_pin_t* p, uint64_t now)
+{
+	int i;
+	int level = p->idle_level;
+
+	for (i = 0; (i < p->wave_count) && (p->wave_time[i] <= now); i++)
+		level = p->wave_level[i];
+
+	return level;
+}
+
+static void sim_wave_reset(sim_pin_t* p)
+{
+	p->wave_count = 0;
+	p->wave_next = 0;
+}
+
+static void sim_wave_add(sim_pin_t* p, uint64_t when, int level)
+{
+	if (p->wave_count < SIM_MAX_EDGES)
+	{
+		p->wave_time[p->wave_count] = when;
+		p->wave_level[p->wave_count] = level;
+		p->wave_count++;
+	}
+}
+
+static int sim_parse_list(const char* name, float* values)
+{
+	char* env;
+	char* end;
+	int count = 0;
+
+	env = getenv(name);
+	if (env == NULL)
+		return 0;
+
+	while ((*env != '\0') && (count < SIM_MAX_SCRIPT))
+	{
+		values[count] = strtof(env, &end);
+		if (end == env)
+			break;
+		count++;
+		env = (*end == ',') ? end + 1 : end;
+	}
+
+	return count;
+}
+
+// HC-SR04: a trigger pulse of at least 10us starts a ping, echo goes high for the round trip time
+static void sim_range_trigger(int echopin, uint64_t now)
+{
+	sim_pin_t* echo;
+	uint64_t rise;
+	float inches;
+
+	if (!sim_valid_pin(echopin))
+		return;
+	echo = &pins[echopin];
+
+	inches = script_distance[script_distance_index];
+	script_distance_index = (script_distance_index + 1) % script_distance_count;
+
+	rise = now + SIM_ECHO_DELAY_US;
+	sim_wave_reset(echo);
+	sim_wave_add(echo, rise, HAL_HIGH);
+	if (inches > 0)
+		sim_wave_add(echo, rise + (uint64_t)(inches * SIM_US_PER_INCH), HAL_LOW);
+	else
+		sim_wave_add(echo, rise + SIM_ECHO_NONE_US, HAL_LOW);
+
+	pthread_cond_signal(&sim_cond);
+}
+
+// DHT22: after the host start signal, respond with 80us low, 80us high, 40 bits and release
+static void sim_dht_respond(sim_pin_t* p, uint64_t now)
+{
+	uint8_t data[5];
+	unsigned int hum, temp;
+	uint64_t t;
+	int i;
+	float celsius, humidity;
+
+	celsius = script_celsius[script_dht_index];
+	humidity = script_humidity[script_dht_index];
+	script_dht_index = (script_dht_index + 1) % script_dht_count;
+
+	hum = (unsigned int)(humidity * 10.0f + 0.5f);
+	if (celsius < 0)
+		temp = (unsigned int)(-celsius * 10.0f + 0.5f) | 0x8000;
+	else
+		temp = (unsigned int)(celsius * 10.0f + 0.5f);
+	data[0] = hum >> 8;
+	data[1] = hum & 0xFF;
+	data[2] = temp >> 8;
+	data[3] = temp & 0xFF;
+	data[4] = (data[0] + data[1] + data[2] + data[3]) & 0xFF;
+
+	t = now + SIM_DHT_DELAY_US;
+	sim_wave_reset(p);
+	sim_wave_add(p, t, HAL_LOW);
+	t += SIM_DHT_RESPONSE_US;
+	sim_wave_add(p, t, HAL_HIGH);
+	t += SIM_DHT_RESPONSE_US;
+	for (i = 0; i < 40; i++)
+	{
+		sim_wave_add(p, t, HAL_LOW);
+		t += SIM_DHT_BIT_LOW_US;
+		sim_wave_add(p, t, HAL_HIGH);
+		t += (data[i / 8] & (0x80 >> (i % 8))) ? SIM_DHT_ONE_US : SIM_DHT_ZERO_US;
+	}
+	sim_wave_add(p, t, HAL_LOW);
+	t += SIM_DHT_BIT_LOW_US;
+	sim_wave_add(p, t, HAL_HIGH);
+
+	pthread_cond_signal(&sim_cond);
+}
+
+static int sim_edge_matches(int isr_edge, int level)
+{
+	if (isr_edge == HAL_EDGE_RISING)
+		return (level == HAL_HIGH);
+	else if (isr_edge == HAL_EDGE_FALLING)
+		return (level == HAL_LOW);
+	else
+		return 1;
+}
+
+// Hands waveform edges to the registered ISRs, as wiringPi's interrupt thread would
+static void* sim_event_thread(void* ptr)
+{
+	sim_pin_t* p;
+	sim_pin_t* next;
+	hal_isr_t isr;
+	hal_edge_t edge_function;
+	void* edge_context;
+	uint64_t now, when;
+	struct timespec ts;
+	int i, level;
+
+	pthread_mutex_lock(&sim_lock);
+	while (1)
+	{
+		next = NULL;
+		for (i = 0; i < SIM_MAX_PINS; i++)
+		{
+			p = &pins[i];
+			if ((p->isr == NULL) && (p->edge_function == NULL))
+				continue;
+			while ((p->wave_next < p->wave_count) &&
+			       (!sim_edge_matches(p->isr_edge, p->wave_level[p->wave_next])))
+				p->wave_next++;
+			if ((p->wave_next < p->wave_count) &&
+			    ((next == NULL) || (p->wave_time[p->wave_next] < next->wave_time[next->wave_next])))
+				next = p;
+		}
+
+		if (next == NULL)
+		{
+			pthread_cond_wait(&sim_cond, &sim_lock);
+			continue;
+		}
+
+		// Timestamped callbacks get the exact edge time, they can run late
+		when = next->wave_time[next->wave_next];
+		level = next->wave_level[next->wave_next];
+		now = sim_now_us();
+		if ((next->edge_function != NULL) && (when <= now))
+		{
+			next->wave_next++;
+			edge_function = next->edge_function;
+			edge_context = next->edge_context;
+			pthread_mutex_unlock(&sim_lock);
+			edge_function(edge_context, level, (unsigned int)when);
+			pthread_mutex_lock(&sim_lock);
+			continue;
+		}
+
+		// Sleep until just before the edge, plain ISRs then spin so they run on time
+		if ((when > now) && (((when - now) > SIM_ISR_SPIN_US) || (next->edge_function != NULL)))
+		{
+			if (next->edge_function == NULL)
+				when -= SIM_ISR_SPIN_US;
+			ts.tv_sec = when / 1000000;
+			ts.tv_nsec = (when % 1000000) * 1000;
+			pthread_cond_timedwait(&sim_cond, &sim_lock, &ts);
+			continue;
+		}
+
+		next->wave_next++;
+		isr = next->isr;
+		pthread_mutex_unlock(&sim_lock);
+		while (sim_now_us() < when);
+		isr();
+		pthread_mutex_lock(&sim_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ *********************************************************************************
+ * backend functions
+ *********************************************************************************
+ */
+
+static int sim_setup(void)
+{
+	pthread_condattr_t attr;
+	struct sched_param sched;
+	int count;
+
+	count = sim_parse_list("SUMP_SIM_DISTANCE", script_distance);
+	if (count)
+		script_distance_count = count;
+	count = sim_parse_list("SUMP_SIM_TEMP", script_celsius);
+	if (count && (sim_parse_list("SUMP_SIM_HUMIDITY", script_humidity) == count))
+		script_dht_count = count;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&sim_thread, NULL, sim_event_thread, NULL))
+	{
+		printf("Error - simulator thread create fail\r\n");
+		return -1;
+	}
+	pthread_detach(sim_thread);
+
+	// wiringPi runs its interrupt thread at a raised priority, do the same when permitted
+	memset(&sched, 0, sizeof(sched));
+	sched.sched_priority = SIM_ISR_PRIORITY;
+	pthread_setschedparam(sim_thread, SCHED_FIFO, &sched);
+
+	return 0;
+}
+
+static void sim_pin_mode(int pin, int mode)
+{
+	sim_pin_t* p;
+	int i;
+
+	if (!sim_valid_pin(pin))
+		return;
+	p = &pins[pin];
+
+	pthread_mutex_lock(&sim_lock);
+	for (i = 0; i < dht_count; i++)
+	{
+		if ((pin == dht_pin[i]) && (mode == HAL_INPUT) && (p->mode == HAL_OUTPUT) &&
+		    (p->lowstart != 0) && ((p->highstart - p->lowstart) >= SIM_DHT_START_US))
+		{
+			p->lowstart = 0;
+			sim_dht_respond(p, sim_now_us());
+		}
+	}
+	p->mode = mode;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+static void sim_pull_up_dn(int pin, int pud)
+{
+	if (!sim_valid_pin(pin))
+		return;
+
+	pthread_mutex_lock(&sim_lock);
+	if (pud == HAL_PUD_UP)
+		pins[pin].idle_level = HAL_HIGH;
+	else if (pud == HAL_PUD_DOWN)
+		pins[pin].idle_level = HAL_LOW;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+static int sim_digital_read(int pin)
+{
+	sim_pin_t* p;
+	uint64_t start;
+	int level;
+
+	if (!sim_valid_pin(pin))
+		return HAL_LOW;
+	p = &pins[pin];
+
+	start = sim_now_ns();
+	pthread_mutex_lock(&sim_lock);
+	if (p->mode == HAL_OUTPUT)
+		level = p->out_level;
+	else
+		level = sim_level_at(p, start / 1000);
+	pthread_mutex_unlock(&sim_lock);
+
+	while (sim_now_ns() < (start + read_cost_ns));
+
+	return level;
+}
+
+static void sim_digital_write(int pin, int value)
+{
+	sim_pin_t* p;
+	uint64_t now;
+	int i;
+
+	if (!sim_valid_pin(pin))
+		return;
+	p = &pins[pin];
+	now = sim_now_us();
+
+	pthread_mutex_lock(&sim_lock);
+	if ((value == HAL_HIGH) && (p->out_level == HAL_LOW))
+		p->highstart = now;
+	else if ((value == HAL_LOW) && (p->out_level == HAL_HIGH))
+	{
+		p->lowstart = now;
+		for (i = 0; i < range_count; i++)
+			if ((pin == range_trigger[i]) && (p->mode == HAL_OUTPUT) && ((now - p->highstart) >= 10))
+				sim_range_trigger(range_echo[i], now);
+	}
+	p->out_level = value;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+static int sim_isr(int pin, int edge, hal_isr_t function)
+{
+	if (!sim_valid_pin(pin))
+		return -1;
+
+	pthread_mutex_lock(&sim_lock);
+	pins[pin].isr = function;
+	pins[pin].edge_function = NULL;
+	pins[pin].isr_edge = edge;
+	pins[pin].wave_next = pins[pin].wave_count;
+	pthread_cond_signal(&sim_cond);
+	pthread_mutex_unlock(&sim_lock);
+
+	return 0;
+}
+
+static int sim_isr_ts(int pin, int edge, hal_edge_t function, void* context)
+{
+	if (!sim_valid_pin(pin))
+		return -1;
+
+	pthread_mutex_lock(&sim_lock);
+	pins[pin].isr = NULL;
+	pins[pin].edge_function = function;
+	pins[pin].edge_context = context;
+	pins[pin].isr_edge = edge;
+	pins[pin].wave_next = pins[pin].wave_count;
+	pthread_cond_signal(&sim_cond);
+	pthread_mutex_unlock(&sim_lock);
+
+	return 0;
+}
+
+static void sim_delay_ms(unsigned int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+// Same policy as wiringPi: busy wait short delays, sleep long ones
+static void sim_delay_us(unsigned int us)
+{
+	struct timespec ts;
+
+	if (us == 0)
+		return;
+	else if (us < 100)
+		sim_spin_ns((uint64_t)us * 1000);
+	else
+	{
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = (us % 1000000) * 1000L;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static unsigned int sim_micros(void)
+{
+	return (unsigned int)sim_now_us();
+}
+
+const hal_backend_t hal_sim_backend =
+{
+	"sim",
+	&sim_setup,
+	&sim_pin_mode,
+	&sim_pull_up_dn,
+	&sim_digital_read,
+	&sim_digital_write,
+	&sim_isr,
+	&sim_isr_ts,
+	&sim_delay_ms,
+	&sim_delay_us,
+	&sim_micros
+};
+
+/*
+ *********************************************************************************
+ * simulator controls
+ *********************************************************************************
+ */
+
+void hal_sim_attach_range(int echopin, int triggerpin)
+{
+	pthread_mutex_lock(&sim_lock);
+	if (range_count < SIM_MAX_SENSORS)
+	{
+		range_echo[range_count] = echopin;
+		range_trigger[range_count] = triggerpin;
+		range_count++;
+	}
+	if (sim_valid_pin(echopin))
+		pins[echopin].idle_level = HAL_LOW;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_sim_attach_dht(int pin)
+{
+	pthread_mutex_lock(&sim_lock);
+	if (dht_count < SIM_MAX_SENSORS)
+		dht_pin[dht_count++] = pin;
+	if (sim_valid_pin(pin))
+		pins[pin].idle_level = HAL_HIGH; // DHT22 data line has a pull-up
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_sim_script_distance(const float* inches, int count)
+{
+	if ((count <= 0) || (count > SIM_MAX_SCRIPT))
+		return;
+
+	pthread_mutex_lock(&sim_lock);
+	memcpy(script_distance, inches, count * sizeof(float));
+	script_distance_count = count;
+	script_distance_index = 0;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_sim_script_dht(const float* celsius, const float* humidity, int count)
+{
+	if ((count <= 0) || (count > SIM_MAX_SCRIPT))
+		return;
+
+	pthread_mutex_lock(&sim_lock);
+	memcpy(script_celsius, celsius, count * sizeof(float));
+	memcpy(script_humidity, humidity, count * sizeof(float));
+	script_dht_count = count;
+	script_dht_index = 0;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_sim_set_read_cost(unsigned int ns)
+{
+	read_cost_ns = ns;
+}
@@ -0,0 +1,288 @@
+/*
+ * hal_wiringpi.c:
+ *      GPIO/timer backend for the raspberry pi, using wiringPi and the
+ *      SoC system timer (timing.c)
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <wiringPi.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "hal.h"
+#include "timing.h"
+
+#define WPI_MAX_ISR_PINS 32
+#define GPIO_CHIP "/dev/gpiochip0"
+
+static hal_edge_t edge_function[WPI_MAX_ISR_PINS];
+static void* edge_context[WPI_MAX_ISR_PINS];
+static int event_fd[WPI_MAX_ISR_PINS];         // line request of the pin, held for the process lifetime
+static uint64_t event_flags[WPI_MAX_ISR_PINS]; // edges it reports while an input
+static int event_output[WPI_MAX_ISR_PINS];     // configured as an output through the request
+
+static int wpi_setup(void)
+{
+	int pin;
+
+	if (wiringPiSetup() == -1)
+		return -1;
+
+	for (pin = 0; pin < WPI_MAX_ISR_PINS; pin++)
+		event_fd[pin] = -1;
+
+	timing_init(); // falls back to CLOCK_MONOTONIC_RAW without /dev/mem
+
+	return 0;
+}
+
+static void wpi_delay_ms(unsigned int ms)
+{
+	delay(ms);
+}
+
+static void wpi_delay_us(unsigned int us)
+{
+	delayMicroseconds(us);
+}
+
+static unsigned int wpi_micros(void)
+{
+	return timing_us32();
+}
+
+/*
+ * wiringPi ISRs take no arguments, so each pin gets a trampoline that
+ * timestamps the edge and hands it to the registered callback.
+ */
+static void wpi_edge(int pin)
+{
+	unsigned int timestamp = wpi_micros();
+
+	edge_function[pin](edge_context[pin], digitalRead(pin), timestamp);
+}
+
+#define WPI_TRAMPOLINE(n) static void wpi_edge_##n(void) { wpi_edge(n); }
+WPI_TRAMPOLINE(0)
+WPI_TRAMPOLINE(1)
+WPI_TRAMPOLINE(2)
+WPI_TRAMPOLINE(3)
+WPI_TRAMPOLINE(4)
+WPI_TRAMPOLINE(5)
+WPI_TRAMPOLINE(6)
+WPI_TRAMPOLINE(7)
+WPI_TRAMPOLINE(8)
+WPI_TRAMPOLINE(9)
+WPI_TRAMPOLINE(10)
+WPI_TRAMPOLINE(11)
+WPI_TRAMPOLINE(12)
+WPI_TRAMPOLINE(13)
+WPI_TRAMPOLINE(14)
+WPI_TRAMPOLINE(15)
+WPI_TRAMPOLINE(16)
+WPI_TRAMPOLINE(17)
+WPI_TRAMPOLINE(18)
+WPI_TRAMPOLINE(19)
+WPI_TRAMPOLINE(20)
+WPI_TRAMPOLINE(21)
+WPI_TRAMPOLINE(22)
+WPI_TRAMPOLINE(23)
+WPI_TRAMPOLINE(24)
+WPI_TRAMPOLINE(25)
+WPI_TRAMPOLINE(26)
+WPI_TRAMPOLINE(27)
+WPI_TRAMPOLINE(28)
+WPI_TRAMPOLINE(29)
+WPI_TRAMPOLINE(30)
+WPI_TRAMPOLINE(31)
+
+static const hal_isr_t wpi_trampoline[WPI_MAX_ISR_PINS] =
+{
+	&wpi_edge_0, &wpi_edge_1, &wpi_edge_2, &wpi_edge_3, &wpi_edge_4, &wpi_edge_5, &wpi_edge_6, &wpi_edge_7,
+	&wpi_edge_8, &wpi_edge_9, &wpi_edge_10, &wpi_edge_11, &wpi_edge_12, &wpi_edge_13, &wpi_edge_14, &wpi_edge_15,
+	&wpi_edge_16, &wpi_edge_17, &wpi_edge_18, &wpi_edge_19, &wpi_edge_20, &wpi_edge_21, &wpi_edge_22, &wpi_edge_23,
+	&wpi_edge_24, &wpi_edge_25, &wpi_edge_26, &wpi_edge_27, &wpi_edge_28, &wpi_edge_29, &wpi_edge_30, &wpi_edge_31
+};
+
+static void* wpi_event_thread(void* ptr)
+{
+	int pin = (int)(intptr_t)ptr;
+	struct gpio_v2_line_event event;
+
+	// Blocks without events while a driver has the line as an output
+	while (read(event_fd[pin], &event, sizeof(event)) == sizeof(event))
+	{
+		edge_function[pin](edge_context[pin],
+		                   (event.id == GPIO_V2_LINE_EVENT_RISING_EDGE) ? HAL_HIGH : HAL_LOW,
+		                   (unsigned int)(event.timestamp_ns / 1000));
+	}
+
+	return NULL;
+}
+
+// Line configuration for mode, an output starts at value
+static void wpi_line_config(struct gpio_v2_line_config* config, int pin, int mode, int value)
+{
+	memset(config, 0, sizeof(*config));
+	if (mode == HAL_OUTPUT)
+	{
+		config->flags = GPIO_V2_LINE_FLAG_OUTPUT;
+		config->num_attrs = 1;
+		config->attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		config->attrs[0].attr.values = value ? 1 : 0;
+		config->attrs[0].mask = 1;
+	}
+	else
+		config->flags = GPIO_V2_LINE_FLAG_INPUT | event_flags[pin];
+}
+
+/*
+ * Edges from the GPIO character device carry a kernel timestamp and the
+ * edge direction, so they stay exact for pulses shorter than the ISR
+ * latency. Each pin is requested once and kept, with its reader thread,
+ * for the life of the process. The request owns the line, so while it is
+ * held the pin's mode and output level go through it (wpi_pin_mode,
+ * wpi_digital_write): a driver that drives the pin, like the DHT start
+ * pulse, reconfigures the same request as an output and back, and no
+ * edges are reported in between.
+ */
+static int wpi_event_request(int pin, int edge)
+{
+	struct gpio_v2_line_request req;
+	pthread_t thread;
+	int chipfd, err;
+
+	if (edge == HAL_EDGE_RISING)
+		event_flags[pin] = GPIO_V2_LINE_FLAG_EDGE_RISING;
+	else if (edge == HAL_EDGE_FALLING)
+		event_flags[pin] = GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	else
+		event_flags[pin] = GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+	// Already requested, only the edges can change
+	if (event_fd[pin] >= 0)
+	{
+		wpi_line_config(&req.config, pin, event_output[pin] ? HAL_OUTPUT : HAL_INPUT, digitalRead(pin));
+		return ioctl(event_fd[pin], GPIO_V2_LINE_SET_CONFIG_IOCTL, &req.config);
+	}
+
+	chipfd = open(GPIO_CHIP, O_RDONLY);
+	if (chipfd < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = wpiPinToGpio(pin);
+	req.num_lines = 1;
+	strcpy(req.consumer, "sump");
+	wpi_line_config(&req.config, pin, HAL_INPUT, 0);
+
+	err = ioctl(chipfd, GPIO_V2_GET_LINE_IOCTL, &req);
+	close(chipfd);
+	if (err < 0)
+		return -1;
+
+	event_fd[pin] = req.fd;
+	event_output[pin] = 0;
+	if (pthread_create(&thread, NULL, wpi_event_thread, (void*)(intptr_t)pin))
+	{
+		close(req.fd);
+		event_fd[pin] = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+static int wpi_requested(int pin)
+{
+	return (pin >= 0) && (pin < WPI_MAX_ISR_PINS) && (event_fd[pin] >= 0);
+}
+
+static void wpi_pin_mode(int pin, int mode)
+{
+	struct gpio_v2_line_config config;
+
+	if (wpi_requested(pin) && ((mode == HAL_INPUT) || (mode == HAL_OUTPUT)))
+	{
+		// An output starts at the level the line is at, so there's no glitch
+		wpi_line_config(&config, pin, mode, digitalRead(pin));
+		if (ioctl(event_fd[pin], GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) == 0)
+		{
+			event_output[pin] = (mode == HAL_OUTPUT);
+			return;
+		}
+	}
+
+	pinMode(pin, mode);
+}
+
+static void wpi_digital_write(int pin, int value)
+{
+	struct gpio_v2_line_values values;
+
+	if (wpi_requested(pin) && event_output[pin])
+	{
+		values.bits = value ? 1 : 0;
+		values.mask = 1;
+		if (ioctl(event_fd[pin], GPIO_V2_LINE_SET_VALUES_IOCTL, &values) == 0)
+			return;
+	}
+
+	digitalWrite(pin, value);
+}
+
+static int wpi_isr_ts(int pin, int edge, hal_edge_t function, void* context)
+{
+	if ((pin < 0) || (pin >= WPI_MAX_ISR_PINS))
+		return -1;
+
+	edge_context[pin] = context;
+	edge_function[pin] = function;
+
+	if (wpi_event_request(pin, edge) == 0)
+		return 0;
+
+	// No GPIO character device, fall back to wiringPi interrupts timestamped on entry
+	return wiringPiISR(pin, edge, wpi_trampoline[pin]);
+}
+
+const hal_backend_t hal_wiringpi_backend =
+{
+	"wiringpi",
+	&wpi_setup,
+	&wpi_pin_mode,
+	&pullUpDnControl,
+	&digitalRead,
+	&wpi_digital_write,
+	&wiringPiISR,
+	&wpi_isr_ts,
+	&wpi_delay_ms,
+	&wpi_delay_us,
+	&wpi_micros
+};
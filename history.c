@@ -0,0 +1,210 @@
+/*
+ * history.c:
+ *      In-memory time series of every measurement
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "seqlock.h"
+#include "history.h"
+#include "log.h"
+
+#define HISTORY_MASK (HISTORY_CAPACITY - 1)
+#define HISTORY_MAX_BATCH 1024
+#define RECORD_MAX 48 // longest formatted sample
+#define HEADER_MAX 24 // longest "<count>,<next>"
+
+static seqlock_t history_lock = SEQLOCK_INITIALIZER; // one writer, the sensor thread
+static unsigned int history_head; // samples ever added, the next goes in history_head & HISTORY_MASK
+static unsigned int history_time[HISTORY_CAPACITY];
+static float history_distance[HISTORY_CAPACITY];
+static float history_temp[HISTORY_CAPACITY];
+static float history_humidity[HISTORY_CAPACITY];
+
+/*
+ *********************************************************************************
+ * support functions
+ *********************************************************************************
+ */
+
+static int tenths(float value)
+{
+	return (int)(value * 10.0f + ((value < 0) ? -0.5f : 0.5f));
+}
+
+static unsigned int history_oldest(unsigned int head)
+{
+	return (head > HISTORY_CAPACITY) ? head - HISTORY_CAPACITY : 0;
+}
+
+// Room for the records of a batch formatted into size bytes
+static int history_limit(int size)
+{
+	return ((size - HEADER_MAX) < HISTORY_MAX_BATCH) ? (size - HEADER_MAX) : HISTORY_MAX_BATCH;
+}
+
+// ";delta,distance,temp,humidity" of sample i, the delta from time prev
+static int record_format(char* buf, unsigned int i, unsigned int prev)
+{
+	unsigned int slot = i & HISTORY_MASK;
+
+	return sprintf(buf, ";%u,%d,%d,%d",
+	               history_time[slot] - prev,
+	               tenths(history_distance[slot]),
+	               tenths(history_temp[slot]),
+	               tenths(history_humidity[slot]));
+}
+
+// The oldest sample, no older than first, from which the samples up to head fit in limit
+static unsigned int history_fit(unsigned int first, unsigned int head, int limit)
+{
+	char record[RECORD_MAX];
+	unsigned int i;
+	int len = 0;
+
+	for (i = head; i != first; i--)
+	{
+		// The oldest sample in a batch carries its full time, the others a delta
+		if ((len + record_format(record, i - 1, 0)) > limit)
+			break;
+		if ((i - 1) != first)
+			len += record_format(record, i - 1, history_time[(i - 2) & HISTORY_MASK]);
+	}
+
+	return i;
+}
+
+// Format samples first..head that are no later than to. Call inside a read section.
+static int history_format(unsigned int first, unsigned int head, unsigned int to, char* out, int size)
+{
+	char records[HISTORY_MAX_BATCH + 1];
+	char record[RECORD_MAX];
+	unsigned int i, slot, prev, next;
+	int len, n, limit, count;
+
+	limit = history_limit(size);
+	len = 0;
+	count = 0;
+	next = 0;
+	prev = 0;
+	records[0] = 0;
+	for (i = first; i != head; i++)
+	{
+		slot = i & HISTORY_MASK;
+		if (history_time[slot] > to)
+			break;
+		n = record_format(record, i, prev);
+		if ((len + n) > limit)
+		{
+			next = history_time[slot];
+			break;
+		}
+
+		memcpy(&records[len], record, n + 1);
+		len += n;
+		prev = history_time[slot];
+		count++;
+	}
+
+	return snprintf(out, size, "%d,%u%s", count, next, records);
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+void history_add(unsigned int time, float distance, float temp, float humidity)
+{
+	unsigned int slot;
+
+	seqlock_write_begin(&history_lock);
+
+	// The search by time and the delta encoding need samples in time order. When the
+	// wall clock steps back (NTP on a Pi without an RTC) the older samples are dropped.
+	if ((history_head != 0) && (time < history_time[(history_head - 1) & HISTORY_MASK]))
+	{
+		log_warn("History cleared, the clock went back %u seconds", history_time[(history_head - 1) & HISTORY_MASK] - time);
+		history_head = 0;
+	}
+
+	slot = history_head & HISTORY_MASK;
+	history_time[slot] = time;
+	history_distance[slot] = distance;
+	history_temp[slot] = temp;
+	history_humidity[slot] = humidity;
+	history_head++;
+	seqlock_write_end(&history_lock);
+}
+
+int history_last(int count, char* out, int size)
+{
+	unsigned int seq, head, first;
+	int len;
+
+	do
+	{
+		seq = seqlock_read_begin(&history_lock);
+		head = history_head;
+		first = history_oldest(head);
+		if ((count >= 0) && ((head - first) > (unsigned int)count))
+			first = head - count;
+		// The newest samples that fit, rather than the oldest of count and a cursor
+		first = history_fit(first, head, history_limit(size));
+		len = history_format(first, head, 0xFFFFFFFF, out, size);
+	}
+	while (seqlock_read_retry(&history_lock, seq));
+
+	return len;
+}
+
+int history_range(unsigned int from, unsigned int to, char* out, int size)
+{
+	unsigned int seq, head, lo, hi, mid;
+	int len;
+
+	do
+	{
+		seq = seqlock_read_begin(&history_lock);
+		head = history_head;
+
+		// Samples are in time order, find the first one at or after from
+		lo = history_oldest(head);
+		hi = head;
+		while (lo < hi)
+		{
+			mid = lo + ((hi - lo) / 2);
+			if (history_time[mid & HISTORY_MASK] < from)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		len = history_format(lo, head, to, out, size);
+	}
+	while (seqlock_read_retry(&history_lock, seq));
+
+	return len;
+}
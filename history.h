@@ -0,0 +1,49 @@
+/*
+ * history.h:
+ *      In-memory time series of every measurement
+ *
+ *	Samples are kept in a fixed size ring, one array per field, so a
+ *	range query walks contiguous memory. Queries are formatted as one
+ *	compact batch that fits a single response datagram:
+ *
+ *	<count>,<next>;<time>,<distance>,<temp>,<humidity>;<dtime>,...
+ *
+ *	time is seconds since the epoch for the first sample, and the delta
+ *	from the previous sample after that. Values are tenths (inches,
+ *	degrees F, percent). next is the time of the first sample that did
+ *	not fit, 0 if the batch is complete, so a client continues with a
+ *	range query starting there.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#define HISTORY_CAPACITY 4096 // power of 2, almost 3 days at a 60 second sensor period
+
+// Samples are added in time order, one earlier than the newest clears the history
+void history_add(unsigned int time, float distance, float temp, float humidity);
+// Format the newest count samples, fewer if they don't all fit
+int history_last(int count, char* out, int size);
+// Format the samples taken from time from up to time to
+int history_range(unsigned int from, unsigned int to, char* out, int size);
+
+#endif
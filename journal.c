@@ -0,0 +1,453 @@
+/*
+ * journal.c:
+ *      Crash-safe append-only journal of records
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "journal.h"
+#include "log.h"
+
+#define JOURNAL_MAGIC "SUMPJNL1"
+#define JOURNAL_FLUSH_MS 1000 // appends are gathered this long before an msync
+#define SEGMENT_NAME "%s/journal-%08u"
+#define RECORD_ALIGN 4
+
+typedef struct
+{
+	char magic[8];
+	uint32_t seq;
+	uint32_t reserved;
+} segment_header_t;
+
+// crc covers everything after it, up to the end of the payload
+typedef struct
+{
+	uint32_t crc;
+	uint16_t len;
+	uint8_t type;
+	uint8_t reserved;
+} record_header_t;
+
+typedef struct
+{
+	unsigned char* map; // NULL when there is no segment
+	unsigned int seq;
+	unsigned int synced; // bytes known to be on disk
+} segment_t;
+
+#define MAX_RECORD ((sizeof(record_header_t) + JOURNAL_MAX_PAYLOAD + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1))
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond; // work for the flusher, or a retired segment taken
+static pthread_t flusher;
+static char journal_dir[200];
+static int journal_dirfd = -1;
+static int journal_exit;
+static int dir_dirty; // a segment was created, the directory needs a sync
+static int creating; // the flusher is creating the spare segment
+static int spare_failed; // don't retry the spare until the next rotation
+static segment_t current, retired, spare;
+static unsigned int tail; // append offset in the current segment
+
+/*
+ *********************************************************************************
+ * segments
+ *********************************************************************************
+ */
+
+static unsigned int record_size(int len)
+{
+	return (sizeof(record_header_t) + len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+// The blocks of an existing segment, it may have been created sparse
+static int segment_reserve(unsigned int seq)
+{
+	char name[250];
+	int fd, err;
+
+	snprintf(name, sizeof(name), SEGMENT_NAME, journal_dir, seq);
+	fd = open(name, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+	err = posix_fallocate(fd, 0, JOURNAL_SEGMENT_SIZE);
+	close(fd);
+
+	return err;
+}
+
+static unsigned char* segment_map(unsigned int seq, int create)
+{
+	char name[250];
+	segment_header_t* header;
+	void* map;
+	int fd, err;
+
+	snprintf(name, sizeof(name), SEGMENT_NAME, journal_dir, seq);
+	fd = open(name, create ? (O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC) : (O_RDWR | O_CLOEXEC), 0644);
+	if (fd < 0)
+		return NULL;
+
+	// Reserve the blocks, a sparse segment on a full card would raise SIGBUS on a write through the map
+	if (create && (err = posix_fallocate(fd, 0, JOURNAL_SEGMENT_SIZE)))
+	{
+		close(fd);
+		unlink(name);
+		errno = err;
+		return NULL;
+	}
+
+	map = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = map;
+	if (create)
+	{
+		memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+		header->seq = seq;
+		header->reserved = 0;
+
+		// Only the newest segments are kept
+		if (seq >= JOURNAL_SEGMENTS)
+		{
+			snprintf(name, sizeof(name), SEGMENT_NAME, journal_dir, seq - JOURNAL_SEGMENTS);
+			unlink(name);
+		}
+	}
+	else if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) || (header->seq != seq))
+	{
+		munmap(map, JOURNAL_SEGMENT_SIZE);
+		return NULL;
+	}
+
+	return map;
+}
+
+// Replay the intact records of a segment, returns the offset after the last one
+static unsigned int segment_replay(unsigned char* map, journal_replay_t replay, void* context)
+{
+	record_header_t* record;
+	unsigned int offset = sizeof(segment_header_t);
+
+	while ((offset + sizeof(record_header_t)) <= JOURNAL_SEGMENT_SIZE)
+	{
+		record = (record_header_t*)&map[offset];
+		if ((record->len == 0) || (record->len > JOURNAL_MAX_PAYLOAD) ||
+		    ((offset + record_size(record->len)) > JOURNAL_SEGMENT_SIZE) ||
+		    (record->crc != crc32(0, &record->len, sizeof(record_header_t) - sizeof(record->crc) + record->len)))
+			break;
+
+		if (replay != NULL)
+			replay(context, record->type, record + 1, record->len);
+		offset += record_size(record->len);
+	}
+
+	return offset;
+}
+
+static void segment_sync(unsigned char* map, unsigned int from, unsigned int to)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	from &= ~(page - 1);
+	if ((to > from) && msync(map + from, to - from, MS_SYNC))
+		log_error("%s[%u] failed msync(): %i", __FUNCTION__, __LINE__, errno);
+}
+
+/*
+ *********************************************************************************
+ * flusher
+ *********************************************************************************
+ */
+
+static void* thread_flusher(void* ptr)
+{
+	struct timespec deadline;
+	segment_t old;
+	unsigned char *map, *next = NULL;
+	unsigned int from, to, seq;
+	int sync_dir;
+
+	pthread_mutex_lock(&journal_lock);
+	while (1)
+	{
+		while (!journal_exit && (current.synced == tail) && (retired.map == NULL) && ((spare.map != NULL) || spare_failed))
+			pthread_cond_wait(&journal_cond, &journal_lock);
+
+		// Let appends gather, one msync then covers them all, once the next segment is ready
+		if (!journal_exit && (current.synced != tail) && (retired.map == NULL) && ((spare.map != NULL) || spare_failed))
+		{
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += JOURNAL_FLUSH_MS / 1000;
+			deadline.tv_nsec += (JOURNAL_FLUSH_MS % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			while (!journal_exit && (retired.map == NULL) &&
+			       (pthread_cond_timedwait(&journal_cond, &journal_lock, &deadline) != ETIMEDOUT));
+		}
+
+		map = current.map;
+		from = current.synced;
+		to = tail;
+		old = retired;
+		sync_dir = dir_dirty;
+		dir_dirty = 0;
+		seq = current.seq + 1;
+		creating = (spare.map == NULL) && !spare_failed && !journal_exit;
+		pthread_mutex_unlock(&journal_lock);
+
+		// The disk is only touched with the lock released, appends never wait on it
+		if (map != NULL)
+			segment_sync(map, from, to);
+		if (old.map != NULL)
+		{
+			segment_sync(old.map, old.synced, JOURNAL_SEGMENT_SIZE);
+			munmap(old.map, JOURNAL_SEGMENT_SIZE);
+		}
+
+		// Have the next segment ready, so a full one is swapped without any system call
+		if (creating)
+		{
+			next = segment_map(seq, 1);
+			if (next == NULL)
+				log_error("Journal segment %u create failed: %i", seq, errno);
+			sync_dir = 1;
+		}
+
+		if (sync_dir && (journal_dirfd >= 0))
+			fsync(journal_dirfd);
+
+		pthread_mutex_lock(&journal_lock);
+		if (current.map == map)
+			current.synced = to;
+		if (old.map != NULL)
+			retired.map = NULL;
+		if (creating)
+		{
+			creating = 0;
+			spare.map = next;
+			spare.seq = seq;
+			spare.synced = 0;
+			spare_failed = (next == NULL);
+		}
+		pthread_cond_broadcast(&journal_cond);
+		if (journal_exit)
+			break;
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	return NULL;
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+int journal_open(const char* dir, journal_replay_t replay, void* context)
+{
+	pthread_condattr_t attr;
+	struct dirent* entry;
+	DIR* d;
+	unsigned int seq, first, last;
+	int found = 0;
+
+	snprintf(journal_dir, sizeof(journal_dir), "%s", dir);
+	mkdir(journal_dir, 0755);
+	d = opendir(journal_dir);
+	if (d == NULL)
+	{
+		log_error("Journal %s open failed: %i", journal_dir, errno);
+		return -1;
+	}
+
+	// Find the kept segments
+	first = last = 0;
+	while ((entry = readdir(d)) != NULL)
+	{
+		if (sscanf(entry->d_name, "journal-%u", &seq) != 1)
+			continue;
+		if (!found || (seq < first))
+			first = seq;
+		if (!found || (seq > last))
+			last = seq;
+		found = 1;
+	}
+	closedir(d);
+
+	if (found && ((last - first) >= JOURNAL_SEGMENTS))
+		first = last - JOURNAL_SEGMENTS + 1;
+
+	// Replay them oldest first, the newest one is appended to
+	for (seq = first; found && (seq <= last); seq++)
+	{
+		current.map = segment_map(seq, 0);
+		if (current.map == NULL)
+			continue;
+		current.seq = seq;
+		tail = segment_replay(current.map, replay, context);
+		if (seq != last)
+		{
+			munmap(current.map, JOURNAL_SEGMENT_SIZE);
+			current.map = NULL;
+		}
+	}
+
+	if (current.map == NULL)
+	{
+		current.seq = found ? last + 1 : 0;
+		current.map = segment_map(current.seq, 1);
+		if (current.map == NULL)
+		{
+			log_error("Journal segment %u create failed: %i", current.seq, errno);
+			return -1;
+		}
+		tail = sizeof(segment_header_t);
+	}
+	else if ((errno = segment_reserve(current.seq)))
+	{
+		log_error("Journal segment %u reserve failed: %i", current.seq, errno);
+		munmap(current.map, JOURNAL_SEGMENT_SIZE);
+		current.map = NULL;
+		return -1;
+	}
+	else if (tail < JOURNAL_SEGMENT_SIZE)
+	{
+		// Clear what is left of a torn record, so it can't be mistaken for one later
+		memset(current.map + tail, 0, ((JOURNAL_SEGMENT_SIZE - tail) < MAX_RECORD) ? (JOURNAL_SEGMENT_SIZE - tail) : MAX_RECORD);
+	}
+	current.synced = 0;
+	dir_dirty = 1;
+
+	journal_dirfd = open(journal_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&journal_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&flusher, NULL, thread_flusher, NULL))
+	{
+		log_error("Error - journal pthread_create() fail");
+		munmap(current.map, JOURNAL_SEGMENT_SIZE);
+		current.map = NULL;
+		return -1;
+	}
+
+	log_info("Journal %s segment %u at %u", journal_dir, current.seq, tail);
+	return 0;
+}
+
+int journal_append(int type, const void* payload, int len)
+{
+	unsigned char buf[MAX_RECORD];
+	record_header_t* record = (record_header_t*)buf;
+	unsigned int size;
+
+	if ((len <= 0) || (len > JOURNAL_MAX_PAYLOAD))
+		return -1;
+
+	// Build the record before taking the lock
+	size = record_size(len);
+	memset(buf, 0, size);
+	record->len = len;
+	record->type = type;
+	memcpy(record + 1, payload, len);
+	record->crc = crc32(0, &record->len, sizeof(record_header_t) - sizeof(record->crc) + len);
+
+	pthread_mutex_lock(&journal_lock);
+	if (current.map == NULL)
+	{
+		pthread_mutex_unlock(&journal_lock);
+		return -1;
+	}
+
+	if ((tail + size) > JOURNAL_SEGMENT_SIZE)
+	{
+		// Until the flusher has the next segment ready, and the last full one
+		// taken, the record is dropped rather than waiting on the disk here
+		if ((spare.map == NULL) || (retired.map != NULL))
+		{
+			spare_failed = 0; // have the flusher try again
+			pthread_cond_broadcast(&journal_cond);
+			pthread_mutex_unlock(&journal_lock);
+			return -1;
+		}
+
+		// Hand the full segment to the flusher, and swap in the next one
+		retired = current;
+		current = spare;
+		spare.map = NULL;
+		tail = sizeof(segment_header_t);
+	}
+
+	memcpy(current.map + tail, buf, size);
+	tail += size;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_lock);
+
+	return 0;
+}
+
+void journal_close(void)
+{
+	if (current.map == NULL)
+		return;
+
+	pthread_mutex_lock(&journal_lock);
+	journal_exit = 1;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_lock);
+	pthread_join(flusher, NULL);
+
+	// The flusher synced everything appended before it saw journal_exit
+	pthread_mutex_lock(&journal_lock);
+	segment_sync(current.map, current.synced, tail);
+	munmap(current.map, JOURNAL_SEGMENT_SIZE);
+	current.map = NULL;
+	if (spare.map != NULL)
+		munmap(spare.map, JOURNAL_SEGMENT_SIZE);
+	spare.map = NULL;
+	pthread_mutex_unlock(&journal_lock);
+
+	if (journal_dirfd >= 0)
+		close(journal_dirfd);
+	journal_dirfd = -1;
+}
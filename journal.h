@@ -0,0 +1,53 @@
+/*
+ * journal.h:
+ *      Crash-safe append-only journal of records
+ *
+ *	Records go to fixed size segment files that are memory mapped, so
+ *	an append is a copy into the page cache. A flusher thread msyncs
+ *	what was appended in batches, and prepares the next segment before
+ *	it is needed. Only the newest JOURNAL_SEGMENTS segments are kept.
+ *
+ *	Each record carries a CRC-32. At startup every kept segment is
+ *	scanned in order and each intact record is handed to a replay
+ *	callback; a torn record at the end of the last segment ends the
+ *	scan, and appending resumes over it.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_SEGMENT_SIZE (1024 * 1024) // about 37000 samples
+#define JOURNAL_SEGMENTS 4
+#define JOURNAL_MAX_PAYLOAD 240
+
+// Called for each intact record found at startup, oldest first
+typedef void (*journal_replay_t)(void* context, int type, const void* payload, int len);
+
+// Replay the journal in dir, then start appending to it. -1 if it can't be used.
+int journal_open(const char* dir, journal_replay_t replay, void* context);
+// Append a record, type 1-255. Never waits on the disk: -1 if the next
+// segment isn't ready yet when the current one is full, the record is dropped.
+int journal_append(int type, const void* payload, int len);
+// Sync everything appended and stop the flusher
+void journal_close(void);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * lifecycle.c:
+ *      Process startup and shutdown
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#define _GNU_SOURCE // pthread_timedjoin_np
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "lifecycle.h"
+#include "log.h"
+
+static pthread_mutex_t lifecycle_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sigfd = -1;
+static int postfd = -1; // readiness and exit requests
+static int ready;
+static int exiting;
+static struct timespec shutdown_deadline; // CLOCK_MONOTONIC
+static void (*usr1_handler)(void);
+
+static void post(void)
+{
+	uint64_t one = 1;
+
+	if (write(postfd, &one, sizeof(one)) != sizeof(one))
+		log_error("%s[%u] failed eventfd write", __FUNCTION__, __LINE__);
+}
+
+/*
+ * Block until a signal or a post, and act on them. Returns the state
+ * the caller waits for: ready, or exiting.
+ */
+static int wait_event(int want_ready)
+{
+	struct pollfd fds[2];
+	struct signalfd_siginfo info;
+	uint64_t count;
+	int done;
+
+	while (1)
+	{
+		pthread_mutex_lock(&lifecycle_lock);
+		done = exiting || (want_ready && ready);
+		pthread_mutex_unlock(&lifecycle_lock);
+		if (done)
+			return exiting ? -1 : 0;
+
+		fds[0].fd = sigfd;
+		fds[0].events = POLLIN;
+		fds[1].fd = postfd;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno != EINTR)
+				log_error("%s[%u] failed poll(): %i", __FUNCTION__, __LINE__, errno);
+			continue;
+		}
+
+		if ((fds[0].revents & POLLIN) && (read(sigfd, &info, sizeof(info)) == sizeof(info)))
+		{
+			if (info.ssi_signo != SIGUSR1)
+				lifecycle_request_exit(strsignal(info.ssi_signo));
+			else if (usr1_handler != NULL)
+				usr1_handler();
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			if (read(postfd, &count, sizeof(count)) != sizeof(count))
+				log_error("%s[%u] failed eventfd read", __FUNCTION__, __LINE__);
+		}
+	}
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+int lifecycle_init(void)
+{
+	sigset_t mask;
+
+	// Blocked here, every thread created later inherits the mask
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL))
+		return -1;
+
+	sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	postfd = eventfd(0, EFD_CLOEXEC);
+	if ((sigfd < 0) || (postfd < 0))
+	{
+		log_error("Error - lifecycle descriptors fail");
+		return -1;
+	}
+
+	return 0;
+}
+
+void lifecycle_set_ready(void)
+{
+	pthread_mutex_lock(&lifecycle_lock);
+	if (!ready)
+	{
+		ready = 1;
+		post();
+	}
+	pthread_mutex_unlock(&lifecycle_lock);
+}
+
+void lifecycle_request_exit(const char* reason)
+{
+	pthread_mutex_lock(&lifecycle_lock);
+	if (!exiting)
+	{
+		log_info("Exit requested: %s", reason);
+		exiting = 1;
+		clock_gettime(CLOCK_MONOTONIC, &shutdown_deadline);
+		shutdown_deadline.tv_sec += LIFECYCLE_SHUTDOWN_MS / 1000;
+		shutdown_deadline.tv_nsec += (LIFECYCLE_SHUTDOWN_MS % 1000) * 1000000;
+		if (shutdown_deadline.tv_nsec >= 1000000000)
+		{
+			shutdown_deadline.tv_sec++;
+			shutdown_deadline.tv_nsec -= 1000000000;
+		}
+		post();
+	}
+	pthread_mutex_unlock(&lifecycle_lock);
+}
+
+void lifecycle_set_usr1_handler(void (*handler)(void))
+{
+	usr1_handler = handler;
+}
+
+int lifecycle_wait_ready(void)
+{
+	return wait_event(1);
+}
+
+void lifecycle_wait_exit(void)
+{
+	wait_event(0);
+}
+
+// What is left of the shutdown budget, all of it before an exit is requested
+static void time_left(struct timespec* left)
+{
+	struct timespec now;
+
+	pthread_mutex_lock(&lifecycle_lock);
+	if (!exiting)
+	{
+		pthread_mutex_unlock(&lifecycle_lock);
+		left->tv_sec = LIFECYCLE_SHUTDOWN_MS / 1000;
+		left->tv_nsec = (LIFECYCLE_SHUTDOWN_MS % 1000) * 1000000;
+		return;
+	}
+	*left = shutdown_deadline;
+	pthread_mutex_unlock(&lifecycle_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left->tv_sec -= now.tv_sec;
+	left->tv_nsec -= now.tv_nsec;
+	if (left->tv_nsec < 0)
+	{
+		left->tv_sec--;
+		left->tv_nsec += 1000000000;
+	}
+	if (left->tv_sec < 0)
+		left->tv_sec = left->tv_nsec = 0;
+}
+
+int lifecycle_remaining_ms(void)
+{
+	struct timespec left;
+
+	time_left(&left);
+
+	return (int)((left.tv_sec * 1000) + (left.tv_nsec / 1000000));
+}
+
+int lifecycle_join(pthread_t thread, const char* name)
+{
+	struct timespec left, deadline;
+
+	// pthread_timedjoin_np takes a CLOCK_REALTIME deadline, carry the time left over to it
+	time_left(&left);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += left.tv_sec;
+	deadline.tv_nsec += left.tv_nsec;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	if (pthread_timedjoin_np(thread, NULL, &deadline))
+	{
+		log_warn("Thread %s did not stop in time, leaving it", name);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * lifecycle.h:
+ *      Process startup and shutdown
+ *
+ *	main blocks here instead of spinning. lifecycle_init blocks SIGTERM,
+ *	SIGINT and SIGUSR1, so it must run before any thread is created;
+ *	they are then read from a signalfd. Other threads post readiness or an exit
+ *	request through an eventfd. Once an exit is requested, every
+ *	lifecycle_join shares one LIFECYCLE_SHUTDOWN_MS budget.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef LIFECYCLE_H
+#define LIFECYCLE_H
+
+#include <pthread.h>
+
+#define LIFECYCLE_SHUTDOWN_MS 10000
+
+int lifecycle_init(void);
+// Called once the first sample is available
+void lifecycle_set_ready(void);
+// Called from any thread, the reason is logged
+void lifecycle_request_exit(const char* reason);
+// Called from the main thread on SIGUSR1
+void lifecycle_set_usr1_handler(void (*handler)(void));
+// 0 once ready, -1 if an exit was requested first
+int lifecycle_wait_ready(void);
+void lifecycle_wait_exit(void);
+// Join within what is left of the shutdown budget, -1 if the thread was left behind
+int lifecycle_join(pthread_t thread, const char* name);
+// Milliseconds left of the shutdown budget, for waits on the way out
+int lifecycle_remaining_ms(void);
+
+#endif
@@ -0,0 +1,608 @@
+/*
+ * log.c:
+ *      Asynchronous logger
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include "log.h"
+
+#define LOG_RING_SIZE 512 // power of 2
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_SLOT_ARGS 216 // encoded argument bytes per record, a slot is 256 bytes
+#define LOG_LINE_MAX 512
+#define LOG_BATCH 16384 // bytes per write
+
+enum { LEN_INT, LEN_CHAR, LEN_SHORT, LEN_LONG, LEN_LLONG, LEN_SIZE, LEN_MAX, LEN_PTRDIFF, LEN_LDOUBLE };
+
+typedef struct
+{
+	unsigned int sequence; // ring position the slot is free for, or that position + 1 once written
+	unsigned char level;
+	unsigned char truncated;
+	unsigned short len;    // bytes used in args
+	const char* format;
+	struct timespec time;  // CLOCK_REALTIME
+	unsigned char args[LOG_SLOT_ARGS];
+} log_slot_t;
+
+// One conversion of a format string
+typedef struct
+{
+	const char* start; // the '%'
+	const char* end;   // after the conversion character
+	int stars;         // '*' width and precision arguments taken before the value
+	int size;          // LEN_ length modifier
+	char conversion;
+} log_spec_t;
+
+int log_level = LOG_LEVEL_INFO;
+
+static log_slot_t ring[LOG_RING_SIZE];
+static unsigned int ring_tail; // next position a producer claims
+static unsigned int ring_head; // next position the drain thread reads, only it touches this
+static unsigned int dropped;
+static int running;
+static int stopping;
+static int drain_sleeping;
+static int outfd = STDERR_FILENO;
+static int wakefd = -1;
+static pthread_t drain_thread;
+
+static const char level_char[] = "EWID";
+
+/*
+ *********************************************************************************
+ * encoding
+ *********************************************************************************
+ */
+
+// p is at a '%', returns the character after the conversion
+static const char* parse_spec(const char* p, log_spec_t* spec)
+{
+	spec->start = p++;
+	spec->stars = 0;
+	spec->size = LEN_INT;
+
+	while ((*p != 0) && (strchr("-+ #0", *p) != NULL))
+		p++;
+	for (; (*p == '*') || ((*p >= '0') && (*p <= '9')) || (*p == '.'); p++)
+		if (*p == '*')
+			spec->stars++;
+
+	switch (*p)
+	{
+		case 'h':
+			spec->size = (p[1] == 'h') ? LEN_CHAR : LEN_SHORT;
+			p += (p[1] == 'h') ? 2 : 1;
+			break;
+		case 'l':
+			spec->size = (p[1] == 'l') ? LEN_LLONG : LEN_LONG;
+			p += (p[1] == 'l') ? 2 : 1;
+			break;
+		case 'z': spec->size = LEN_SIZE; p++; break;
+		case 'j': spec->size = LEN_MAX; p++; break;
+		case 't': spec->size = LEN_PTRDIFF; p++; break;
+		case 'L': spec->size = LEN_LDOUBLE; p++; break;
+	}
+
+	spec->conversion = *p;
+	if (*p != 0)
+		p++;
+	spec->end = p;
+	return p;
+}
+
+static int put(log_slot_t* slot, const void* value, int size)
+{
+	if ((slot->len + size) > LOG_SLOT_ARGS)
+	{
+		slot->truncated = 1;
+		return -1;
+	}
+	memcpy(&slot->args[slot->len], value, size);
+	slot->len += size;
+	return 0;
+}
+
+static int put_string(log_slot_t* slot, const char* s)
+{
+	int room = LOG_SLOT_ARGS - slot->len;
+	int n;
+
+	if (s == NULL)
+		s = "(null)";
+	n = strnlen(s, room);
+	if (n == room)
+	{
+		slot->truncated = 1;
+		if (n == 0)
+			return -1;
+		n--; // keep the part that fits
+	}
+	memcpy(&slot->args[slot->len], s, n);
+	slot->args[slot->len + n] = 0;
+	slot->len += n + 1;
+	return 0;
+}
+
+// Copy the arguments, promoted to 64 bits, strings by value. Stops at the first that does not fit.
+static void encode(log_slot_t* slot, const char* format, va_list* ap)
+{
+	log_spec_t spec;
+	const char* p = format;
+	int64_t i;
+	uint64_t u;
+	double d;
+	int star, err = 0;
+
+	slot->len = 0;
+	slot->truncated = 0;
+	while ((*p != 0) && !err)
+	{
+		if (*p++ != '%')
+			continue;
+		p = parse_spec(p - 1, &spec);
+
+		for (star = 0; star < spec.stars; star++)
+		{
+			i = va_arg(*ap, int);
+			err |= put(slot, &i, sizeof(i));
+		}
+
+		switch (spec.conversion)
+		{
+			case 'd': case 'i':
+				switch (spec.size)
+				{
+					case LEN_CHAR: i = (signed char)va_arg(*ap, int); break;
+					case LEN_SHORT: i = (short)va_arg(*ap, int); break;
+					case LEN_LONG: i = va_arg(*ap, long); break;
+					case LEN_LLONG: i = va_arg(*ap, long long); break;
+					case LEN_SIZE: i = va_arg(*ap, ssize_t); break;
+					case LEN_MAX: i = va_arg(*ap, intmax_t); break;
+					case LEN_PTRDIFF: i = va_arg(*ap, ptrdiff_t); break;
+					default: i = va_arg(*ap, int); break;
+				}
+				err |= put(slot, &i, sizeof(i));
+				break;
+			case 'u': case 'x': case 'X': case 'o':
+				switch (spec.size)
+				{
+					case LEN_CHAR: u = (unsigned char)va_arg(*ap, unsigned int); break;
+					case LEN_SHORT: u = (unsigned short)va_arg(*ap, unsigned int); break;
+					case LEN_LONG: u = va_arg(*ap, unsigned long); break;
+					case LEN_LLONG: u = va_arg(*ap, unsigned long long); break;
+					case LEN_SIZE: u = va_arg(*ap, size_t); break;
+					case LEN_MAX: u = va_arg(*ap, uintmax_t); break;
+					case LEN_PTRDIFF: u = va_arg(*ap, ptrdiff_t); break;
+					default: u = va_arg(*ap, unsigned int); break;
+				}
+				err |= put(slot, &u, sizeof(u));
+				break;
+			case 'c':
+				i = va_arg(*ap, int);
+				err |= put(slot, &i, sizeof(i));
+				break;
+			case 'p':
+				u = (uintptr_t)va_arg(*ap, void*);
+				err |= put(slot, &u, sizeof(u));
+				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+				d = (spec.size == LEN_LDOUBLE) ? (double)va_arg(*ap, long double) : va_arg(*ap, double);
+				err |= put(slot, &d, sizeof(d));
+				break;
+			case 's':
+				err |= put_string(slot, va_arg(*ap, const char*));
+				break;
+			case 'n':
+				va_arg(*ap, void*); // not supported, nothing is written back
+				break;
+			case '%':
+				break;
+			default:
+				err = -1; // unknown conversion, the arguments after it can not be found
+				slot->truncated = 1;
+				break;
+		}
+	}
+}
+
+/*
+ *********************************************************************************
+ * decoding, drain thread only
+ *********************************************************************************
+ */
+
+static int get(log_slot_t* slot, int* offset, void* value, int size)
+{
+	if ((*offset + size) > slot->len)
+		return -1;
+	memcpy(value, &slot->args[*offset], size);
+	*offset += size;
+	return 0;
+}
+
+// Rebuild the spec with '*' resolved, the length modifier replaced by extra, and format one value
+static int format_spec(log_slot_t* slot, int* offset, log_spec_t* spec, const char* extra, char* spec_out)
+{
+	const char* p;
+	int64_t star;
+	int n = 0;
+
+	for (p = spec->start; p < (spec->end - 1); p++)
+	{
+		if (*p == '*')
+		{
+			if (get(slot, offset, &star, sizeof(star)))
+				return -1;
+			n += sprintf(&spec_out[n], "%d", (int)star);
+		}
+		else if (strchr("hlzjtL", *p) == NULL)
+			spec_out[n++] = *p;
+	}
+	strcpy(&spec_out[n], extra);
+	n += strlen(extra);
+	spec_out[n++] = spec->conversion;
+	spec_out[n] = 0;
+
+	return 0;
+}
+
+// "date time.us L message\n", returns the length
+static int log_format(log_slot_t* slot, char* out, int size)
+{
+	static __thread time_t date_sec; // per thread, the direct writes format outside the drain thread
+	static __thread char date[32];
+	static __thread int date_len;
+	log_spec_t spec;
+	const char* p;
+	const char* literal;
+	char specbuf[64];
+	struct tm tm;
+	int64_t i;
+	uint64_t u;
+	double d;
+	int offset = 0;
+	int len, n, err = 0;
+
+	// Most records share their second with the one before
+	if ((slot->time.tv_sec != date_sec) || (date_len == 0))
+	{
+		date_sec = slot->time.tv_sec;
+		localtime_r(&date_sec, &tm);
+		date_len = strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	}
+	memcpy(out, date, date_len);
+	len = date_len;
+	len += snprintf(&out[len], size - len, ".%06ld %c ", slot->time.tv_nsec / 1000,
+	                level_char[(slot->level <= LOG_LEVEL_DEBUG) ? slot->level : LOG_LEVEL_DEBUG]);
+
+	size -= 5; // room for " ...\n"
+	p = slot->format;
+	while ((*p != 0) && (len < size) && !err)
+	{
+		literal = p;
+		while ((*p != 0) && (*p != '%'))
+			p++;
+		n = p - literal;
+		if (n > (size - len))
+			n = size - len;
+		memcpy(&out[len], literal, n);
+		len += n;
+		if ((*p == 0) || (len >= size))
+			break;
+
+		p = parse_spec(p, &spec);
+		n = 0;
+		switch (spec.conversion)
+		{
+			case 'd': case 'i':
+				err = format_spec(slot, &offset, &spec, "ll", specbuf) || get(slot, &offset, &i, sizeof(i));
+				if (!err)
+					n = snprintf(&out[len], size - len, specbuf, (long long)i);
+				break;
+			case 'u': case 'x': case 'X': case 'o':
+				err = format_spec(slot, &offset, &spec, "ll", specbuf) || get(slot, &offset, &u, sizeof(u));
+				if (!err)
+					n = snprintf(&out[len], size - len, specbuf, (unsigned long long)u);
+				break;
+			case 'c':
+				err = format_spec(slot, &offset, &spec, "", specbuf) || get(slot, &offset, &i, sizeof(i));
+				if (!err)
+					n = snprintf(&out[len], size - len, specbuf, (int)i);
+				break;
+			case 'p':
+				err = format_spec(slot, &offset, &spec, "", specbuf) || get(slot, &offset, &u, sizeof(u));
+				if (!err)
+					n = snprintf(&out[len], size - len, specbuf, (void*)(uintptr_t)u);
+				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+				err = format_spec(slot, &offset, &spec, "", specbuf) || get(slot, &offset, &d, sizeof(d));
+				if (!err)
+					n = snprintf(&out[len], size - len, specbuf, d);
+				break;
+			case 's':
+				err = format_spec(slot, &offset, &spec, "", specbuf) || (offset >= slot->len);
+				if (!err)
+				{
+					n = snprintf(&out[len], size - len, specbuf, (const char*)&slot->args[offset]);
+					offset += strlen((const char*)&slot->args[offset]) + 1;
+				}
+				break;
+			case '%':
+				out[len] = '%';
+				n = 1;
+				break;
+			default:
+				err = -1;
+				break;
+		}
+		if (n > (size - len))
+			n = size - len;
+		len += n;
+	}
+
+	// A message is one line, whatever the caller ended it with
+	while ((len > 0) && ((out[len - 1] == '\n') || (out[len - 1] == '\r')))
+		len--;
+	if (err || slot->truncated || (len >= size))
+	{
+		memcpy(&out[len], " ...", 4);
+		len += 4;
+	}
+	out[len++] = '\n';
+
+	return len;
+}
+
+static void log_flush(const char* buf, int len)
+{
+	int n;
+
+	while (len > 0)
+	{
+		n = write(outfd, buf, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return; // nowhere to report it
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ *********************************************************************************
+ * ring, multiple producers and the drain thread as the one consumer
+ *********************************************************************************
+ */
+
+static log_slot_t* ring_claim(unsigned int* claimed)
+{
+	log_slot_t* slot;
+	unsigned int pos, seq;
+
+	pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		slot = &ring[pos & LOG_RING_MASK];
+		seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (seq == pos)
+		{
+			if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*claimed = pos;
+				return slot;
+			}
+		}
+		else if ((int)(seq - pos) < 0)
+			return NULL; // full, the drain thread has not freed this slot yet
+		else
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	}
+}
+
+static void ring_publish(log_slot_t* slot, unsigned int pos)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	// Pairs with the fence in thread_log_drain, one of the two sees the other
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&drain_sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&drain_sleeping, 0, __ATOMIC_RELAXED))
+	{
+		// Only fails when the counter would overflow, so a wakeup is pending anyway
+		if (write(wakefd, &one, sizeof(one)) != sizeof(one))
+			return;
+	}
+}
+
+static log_slot_t* ring_peek(void)
+{
+	log_slot_t* slot = &ring[ring_head & LOG_RING_MASK];
+
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != (ring_head + 1))
+		return NULL;
+	return slot;
+}
+
+// Free the slot for the producer one lap later
+static void ring_release(log_slot_t* slot)
+{
+	__atomic_store_n(&slot->sequence, ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	ring_head++;
+}
+
+static void* thread_log_drain(void* ptr)
+{
+	static char batch[LOG_BATCH];
+	log_slot_t* slot;
+	uint64_t count;
+	int len;
+
+	for (;;)
+	{
+		len = 0;
+		while ((slot = ring_peek()) != NULL)
+		{
+			if ((len + LOG_LINE_MAX) > LOG_BATCH)
+			{
+				log_flush(batch, len);
+				len = 0;
+			}
+			len += log_format(slot, &batch[len], LOG_LINE_MAX);
+			ring_release(slot);
+		}
+		log_flush(batch, len);
+
+		if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		__atomic_store_n(&drain_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ring_peek() == NULL)
+		{
+			if (read(wakefd, &count, sizeof(count)) < 0)
+				usleep(10000);
+		}
+		__atomic_store_n(&drain_sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+void log_write(int level, const char* format, ...)
+{
+	log_slot_t local;
+	log_slot_t* slot;
+	unsigned int pos = 0;
+	va_list ap;
+	char line[LOG_LINE_MAX];
+
+	slot = __atomic_load_n(&running, __ATOMIC_ACQUIRE) ? ring_claim(&pos) : &local;
+	if (slot == NULL)
+	{
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &slot->time);
+	slot->level = level;
+	slot->format = format;
+	va_start(ap, format);
+	encode(slot, format, &ap);
+	va_end(ap);
+
+	if (slot != &local)
+		ring_publish(slot, pos);
+	else
+		log_flush(line, log_format(slot, line, sizeof(line)));
+}
+
+int log_open(const char* path)
+{
+	int fd, i;
+
+	if (path != NULL)
+	{
+		fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+		{
+			log_error("Error - log %s open fail: %i", path, errno);
+			return -1;
+		}
+		outfd = fd;
+	}
+
+	wakefd = eventfd(0, EFD_CLOEXEC);
+	if (wakefd < 0)
+	{
+		log_error("Error - log eventfd fail: %i", errno);
+		return -1;
+	}
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].sequence = i;
+	ring_head = ring_tail = 0;
+	stopping = 0;
+
+	if (pthread_create(&drain_thread, NULL, thread_log_drain, NULL))
+	{
+		log_error("Error - log pthread_create() fail");
+		close(wakefd);
+		wakefd = -1;
+		return -1;
+	}
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void log_close(void)
+{
+	uint64_t one = 1;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	if (write(wakefd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(drain_thread, NULL);
+
+	if (dropped)
+		log_warn("%u log records dropped", dropped);
+	if (outfd != STDERR_FILENO)
+	{
+		close(outfd);
+		outfd = STDERR_FILENO;
+	}
+	close(wakefd);
+	wakefd = -1;
+}
+
+unsigned int log_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
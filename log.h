@@ -0,0 +1,60 @@
+/*
+ * log.h:
+ *      Asynchronous logger
+ *
+ *	log_write does not format or do any I/O. It copies the timestamp, the
+ *	format pointer and the raw arguments (strings by value) into a slot
+ *	of a lock-free ring, and a drain thread formats and writes them in
+ *	batches, so logging threads never wait on stdio or the disk. When
+ *	the ring is full the record is dropped and counted.
+ *
+ *	The format must be a string literal, it is read by the drain thread
+ *	later. Messages are single lines, the logger adds the line ending.
+ *	Before log_open and after log_close records are written directly.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// Records above this are skipped by the caller, set at run time by SETLOGLEVEL
+extern int log_level;
+
+#define log_at(level, ...) do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Start the drain thread, appending to path, or stderr if path is NULL
+int log_open(const char* path);
+// Write everything queued and stop the drain thread
+void log_close(void);
+void log_write(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+// Records lost to a full ring
+unsigned int log_dropped(void);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * pumpcycle.c:
+ *      Online sump pump cycle detection
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <string.h>
+#include "pumpcycle.h"
+
+#define DEFAULT_DRAIN_THRESHOLD 1.0 // inches, well above the ranging noise
+#define INFLOW_WEIGHT 0.3f // weight of the newest sample in the inflow average
+#define CYCLE_WINDOW 3600 // seconds counted by cycles_per_hour
+#define MAX_CYCLE_TIMES 128 // power of 2, more cycles an hour than any pump survives
+
+#define PUMP_START 0
+#define PUMP_FILLING 1
+#define PUMP_DRAINING 2
+
+static int pump_state = PUMP_START;
+static float drain_threshold = DEFAULT_DRAIN_THRESHOLD;
+static unsigned int last_time;
+static float last_distance;
+static unsigned int drain_start; // last sample before the level dropped
+static unsigned int cycle_end;   // end of the previous cycle, 0 if none
+// Ends of the cycles in the last CYCLE_WINDOW, oldest at cycle_tail
+static unsigned int cycle_time[MAX_CYCLE_TIMES];
+static unsigned int cycle_head, cycle_tail;
+static int have_inflow;
+static pump_stats_t pump;
+
+static void cycle_ended(unsigned int end)
+{
+	pump.cycles++;
+	pump.run_time = end - drain_start;
+	if ((cycle_end != 0) && (end > cycle_end))
+		pump.duty_pct = (100.0f * pump.run_time) / (end - cycle_end);
+	cycle_end = end;
+
+	if ((cycle_head - cycle_tail) == MAX_CYCLE_TIMES)
+		cycle_tail++;
+	cycle_time[cycle_head++ & (MAX_CYCLE_TIMES - 1)] = end;
+}
+
+void pump_init(float drain_threshold_in)
+{
+	if (drain_threshold_in > 0)
+		drain_threshold = drain_threshold_in;
+	pump_state = PUMP_START;
+	cycle_end = 0;
+	cycle_head = cycle_tail = 0;
+	have_inflow = 0;
+	memset(&pump, 0, sizeof(pump));
+}
+
+void pump_update(unsigned int time, float distance_in, pump_stats_t* stats)
+{
+	float drop, rate;
+
+	if ((pump_state == PUMP_START) || (time <= last_time))
+	{
+		if (pump_state == PUMP_START)
+			pump_state = PUMP_FILLING;
+		last_time = time;
+		last_distance = distance_in;
+		*stats = pump;
+		return;
+	}
+
+	drop = distance_in - last_distance; // positive when the level fell
+	if (pump_state == PUMP_DRAINING)
+	{
+		if (drop < drain_threshold)
+		{
+			// The pump stopped before the previous sample
+			cycle_ended(last_time);
+			pump_state = PUMP_FILLING;
+		}
+	}
+	else if (drop >= drain_threshold)
+	{
+		drain_start = last_time;
+		pump.start_distance = last_distance;
+		pump_state = PUMP_DRAINING;
+	}
+
+	if (pump_state == PUMP_FILLING)
+	{
+		rate = (-drop * 60.0f) / (time - last_time);
+		if (have_inflow)
+			pump.inflow_ipm += INFLOW_WEIGHT * (rate - pump.inflow_ipm);
+		else
+			pump.inflow_ipm = rate;
+		have_inflow = 1;
+	}
+
+	// Forget cycles that left the window, each end is dropped once
+	while ((cycle_tail != cycle_head) && ((time - cycle_time[cycle_tail & (MAX_CYCLE_TIMES - 1)]) > CYCLE_WINDOW))
+		cycle_tail++;
+	pump.cycles_per_hour = cycle_head - cycle_tail;
+	pump.since_cycle = (cycle_end != 0) ? time - cycle_end : 0;
+
+	last_time = time;
+	last_distance = distance_in;
+	*stats = pump;
+}
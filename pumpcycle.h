@@ -0,0 +1,49 @@
+/*
+ * pumpcycle.h:
+ *      Online sump pump cycle detection
+ *
+ *	Each distance sample (sensor down to the water) is fed in as it is
+ *	taken, in constant time. The pit fills while the distance shrinks;
+ *	a jump of at least the drain threshold between samples means the
+ *	pump ran, and the cycle ends at the first sample after which the
+ *	distance stops growing. Run time is only as fine as the sample
+ *	period.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef PUMPCYCLE_H
+#define PUMPCYCLE_H
+
+typedef struct
+{
+	float inflow_ipm;        // fill rate while the pump is off, inches per minute
+	unsigned int run_time;   // seconds the pump ran in the last cycle
+	float cycles_per_hour;   // cycles that ended in the last hour
+	unsigned int since_cycle;// seconds since the last cycle ended, 0 until one is seen
+	float duty_pct;          // run time of the last cycle, percent of its period
+	unsigned int cycles;     // cycles seen since startup
+	float start_distance;    // distance when the pump last started, 0 until one is seen
+} pump_stats_t;
+
+void pump_init(float drain_threshold_in);
+void pump_update(unsigned int time, float distance_in, pump_stats_t* stats);
+
+#endif
@@ -35,269 +35,372 @@
 #include <unistd.h>
 #include <termios.h>
 #include <fcntl.h>
-#include <wiringPi.h>
-#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include "hal.h"
+#include "filter.h"
 #include "range.h"
+#include "log.h"
 
-// Use this define for Raspberry PI A, B, B+
-#define ARMV6
-// Use this define for Raspberry PI B2
-//#define ARMV7
-
-#ifdef ARMV6
-// Physical addresses for various peripheral register sets
-/// Base Physical Address of the ARMV6 BCM 2835 peripheral registers
-#define BCM2835_PERI_BASE               0x20000000
-#endif
+#define TRIGGER_PULSE_US 10 // Minimum HC-S04 trigger pulse time
+#define MAX_DISTANCE_US 23307 // Max distance of HC-S04 in terms of time
+#define MIN_TOTAL_MEASURE_TIME_US 75000 // Minimum HC-S04 measurement time is 60ms
+#define ECHO_TIMEOUT_US (TRIGGER_PULSE_US + MAX_DISTANCE_US + 5000) // Allow for interrupt latency
+#define US_PER_INCH 148.0 // round trip echo time
+#define DEFAULT_MIN_PINGS 3
+#define DEFAULT_TOLERANCE_US 74 // pings agree once their MAD is within half an inch
 
-#ifdef ARMV7
-/// Base Physical Address of the ARMV7 BCM 2835 peripheral registers
-#define BCM2835_PERI_BASE               0x3F000000
-#endif
+// Measurement state, shared with the echo edge callback
+#define RANGE_IDLE 0
+#define RANGE_TRIGGERED 1 // waiting for the echo rising edge
+#define RANGE_ECHO 2      // waiting for the echo falling edge
+#define RANGE_DONE 3
 
-#if (defined ARMV7) && (defined ARMV6)
-#error MUST CHOOSE EITHER AMRV6, or ARMV7, NOT BOTH
-#endif
+static range_t range_default; // the Range* functions
 
-/// Base Physical Address of the System Timer registers
-#define BCM2835_ST_BASE         (BCM2835_PERI_BASE + 0x3000)
+/*
+ * EchoEdge:
+ *      Called from the interrupt thread with the time of each echo edge.
+ *      The echo width is the difference of the two timestamps, nothing polls.
+ *********************************************************************************
+ */
 
-/// Base Physical Address of the Pads registers
-#define BCM2835_GPIO_PADS       (BCM2835_PERI_BASE + 0x100000)
+static void EchoEdge(void* context, int level, unsigned int timestamp)
+{
+	range_t* range = context;
+	struct itimerspec disarm;
+	range_done_t done = NULL;
+	void* done_context = NULL;
+	int err = 0;
+	unsigned int echotime = 0;
 
-/// Base Physical Address of the Clock/timer registers
-#define BCM2835_CLOCK_BASE      (BCM2835_PERI_BASE + 0x101000)
+	pthread_mutex_lock(&range->lock);
+	if ((level == HAL_HIGH) && (range->state == RANGE_TRIGGERED))
+	{
+		range->risetime = timestamp;
+		range->state = RANGE_ECHO;
+	}
+	else if ((level == HAL_LOW) && (range->state == RANGE_ECHO))
+	{
+		// Unsigned difference is correct across the 32 bit timer rollover
+		range->echotime = timestamp - range->risetime;
+
+		// If we get a time < then max capability, take it
+		if (range->echotime < MAX_DISTANCE_US)
+			range->err = 0;
+		else
+			// Time is greater than our max distance, indicate an error
+			range->err = 2;
+
+		range->state = RANGE_DONE;
+		done = range->done;
+		done_context = range->context;
+		err = range->err;
+		echotime = range->echotime;
+		pthread_cond_broadcast(&range->cond);
+		memset(&disarm, 0, sizeof(disarm));
+		timer_settime(range->timer, 0, &disarm, NULL);
+	}
+	pthread_mutex_unlock(&range->lock);
 
-/// Base Physical Address of the GPIO registers
-#define BCM2835_GPIO_BASE       (BCM2835_PERI_BASE + 0x200000)
+	if (done != NULL)
+		done(done_context, err, echotime);
+}
 
-/// Base Physical Address of the SPI0 registers
-#define BCM2835_SPI0_BASE       (BCM2835_PERI_BASE + 0x204000)
+static int timespec_passed(struct timespec* deadline)
+{
+	struct timespec now;
 
-/// Base Physical Address of the BSC0 registers
-#define BCM2835_BSC0_BASE       (BCM2835_PERI_BASE + 0x205000)
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec > deadline->tv_sec) || ((now.tv_sec == deadline->tv_sec) && (now.tv_nsec >= deadline->tv_nsec));
+}
 
-/// Base Physical Address of the PWM registers
-#define BCM2835_GPIO_PWM        (BCM2835_PERI_BASE + 0x20C000)
+/*
+ * Give up on a measurement past its deadline, 1 if the echo never started,
+ * 2 if it never ended. Call with the lock held, returns the callback to call
+ * once it is released.
+ */
+static range_done_t range_expire(range_t* range)
+{
+	if (((range->state != RANGE_TRIGGERED) && (range->state != RANGE_ECHO)) || !timespec_passed(&range->deadline))
+		return NULL;
 
-/// Base Physical Address of the BSC1 registers
-#define BCM2835_BSC1_BASE       (BCM2835_PERI_BASE + 0x804000)
+	range->err = (range->state == RANGE_ECHO) ? 2 : 1;
+	range->echotime = 0;
+	range->state = RANGE_DONE;
+	pthread_cond_broadcast(&range->cond);
 
-#define TIMER_BASE BCM2835_ST_BASE
+	return range->done;
+}
 
-#define TRIGGER_PULSE_US 10 // Minimum HC-S04 trigger pulse time
-#define MAX_DISTANCE_US 23307 // Max distance of HC-S04 in terms of time
-#define MIN_TOTAL_MEASURE_TIME_US 75000 // Minimum HC-S04 measurement time is 60ms
+// Timeout timer, on a thread of its own
+static void EchoTimeout(union sigval value)
+{
+	range_t* range = value.sival_ptr;
+	range_done_t done;
+	void* done_context;
+	int err;
+
+	pthread_mutex_lock(&range->lock);
+	done = range_expire(range);
+	done_context = range->context;
+	err = range->err;
+	pthread_mutex_unlock(&range->lock);
+
+	if (done != NULL)
+		done(done_context, err, 0);
+}
 
-int EchoPin;
-int TriggerPin;
-int mode_verbose;
+static void sleep_until(struct timespec* deadline)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+}
 
-volatile unsigned *timer;
-volatile unsigned isr_time_ready;
-volatile unsigned isr_distancetime;
-volatile unsigned int isr_risetime, isr_falltime;
-volatile unsigned int isr_error;
+static void timespec_add_us(struct timespec* ts, unsigned int us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
 
 /*
- * EchoInterrupt:
+ *********************************************************************************
+ * interface functions
  *********************************************************************************
  */
 
-void EchoInterrupt (void) 
-{ 	
-	unsigned int current_us;
-	unsigned int echopin_state;
-
-	// Mark echo pin rise event
-	isr_risetime = *timer;
+int range_init(range_t* range, int echopin, int triggerpin, int debug)
+{
+	int err = 0;
+	pthread_condattr_t attr;
+	struct sigevent sev;
 	
-	// Wait for echo pin fall event, or timeout
-	do
+	memset(range, 0, sizeof(range_t));
+	range->echopin = echopin;
+	range->triggerpin = triggerpin;
+	range->verbose = debug;
+	range->state = RANGE_IDLE;
+
+	pthread_mutex_init(&range->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&range->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	filter_init(&range->filter, FILTER_HAMPEL, DEFAULT_MIN_PINGS, DEFAULT_TOLERANCE_US);
+
+	// Ends a measurement whose echo edges never come, with or without range_wait
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = EchoTimeout;
+	sev.sigev_value.sival_ptr = range;
+	if (timer_create(CLOCK_MONOTONIC, &sev, &range->timer))
 	{
-		current_us = *timer - isr_risetime;
-		echopin_state = digitalRead(EchoPin);
+		log_error("Range pin %d timer_create failed: %i", range->echopin, errno);
+		err = -1;
 	}
-	while (( echopin_state == HIGH) && (current_us < MAX_DISTANCE_US));
-	isr_distancetime = current_us;
+
+	hal_isr_ts(range->echopin, HAL_EDGE_BOTH, &EchoEdge, range);
+	hal_pull_up_dn(range->echopin, HAL_PUD_DOWN);
+
+	hal_digital_write(range->triggerpin, HAL_LOW);
+	hal_pin_mode(range->triggerpin, HAL_OUTPUT);
 	
-	// If we get a time < then max capability, take it
-	if (isr_distancetime < MAX_DISTANCE_US)
-		isr_time_ready = 1;	
-	else
-		// Time is greater than our max distance, indicate an isr_error
-		isr_error = 1;
+	return err;
 }
 
-int setup_timer()
+void range_set_filter(range_t* range, int kind, int min_pings, unsigned int tolerance_us)
 {
-	int memfd;
-	void *timer_map;
+	filter_init(&range->filter, kind, min_pings, tolerance_us);
+}
 
-	memfd = open("/dev/mem",O_RDWR|O_SYNC);
-	if(memfd < 0)
+void range_begin(range_t* range)
+{
+	filter_reset(&range->filter);
+}
+
+int range_ping(range_t* range)
+{
+	unsigned int echotime;
+	double estimate;
+	int err;
+
+	// The transducer needs time to reset between measurements
+	sleep_until(&range->ready);
+	clock_gettime(CLOCK_MONOTONIC, &range->ready);
+	timespec_add_us(&range->ready, MIN_TOTAL_MEASURE_TIME_US);
+
+	if (range_start(range, NULL, NULL))
+		err = 1;
+	else
+		err = range_wait(range, &echotime);
+		 	
+	// Check for an err
+	switch(err)
 	{
-		printf("Mem open isr_error\n");
-		return(0);
+		case 0:
+			filter_add(&range->filter, echotime);
+			filter_estimate(&range->filter, &estimate);
+			if (range->verbose)
+				log_debug("Distance pin %d: %02i ft, %02i inch, est: %02.02f", range->echopin,
+				          (echotime / 148) / 12, (echotime / 148) % 12, estimate / US_PER_INCH);
+			break;
+		case 1:
+			if (range->verbose) 
+				log_debug("isr_error pin %d: No start pulse", range->echopin);
+			break;
+		case 2:
+			if (range->verbose)
+				log_debug("isr_error pin %d: Measurement out of range", range->echopin);
+			break;
+		default:
+			log_error("FUBAR!");
+			break;
 	}
 
-	timer_map = mmap(NULL,4096,PROT_READ|PROT_WRITE,
-			MAP_SHARED,memfd,TIMER_BASE);
+	return err;
+}
+
+// Take up to average pings, fewer once they agree
+int range_done_pinging(range_t* range, int pings, int average)
+{
+	if (average > FILTER_MAX_COUNT)
+		average = FILTER_MAX_COUNT;
+
+	return (pings >= average) || filter_converged(&range->filter);
+}
 
-	close(memfd);
+double range_result(range_t* range, int err)
+{
+	double estimate;
 
-	if(timer_map == MAP_FAILED)
+	// There is no standards here how we return to linux. For this implementation
+	// I will values > 1 as distance in inches, and values < 0 as errors.
+	// A failed ping only counts if no ping succeeded.
+	if (filter_estimate(&range->filter, &estimate))
+	{
+		if (range->verbose)
+			log_debug("Range pin %d error %i", range->echopin, err * -1);
+		return (err * -1); // Make errors negative
+	}
+	else
 	{
-		printf("Map failed\n");
-		return(1);
+		estimate /= US_PER_INCH;
+		if (range->verbose)
+			log_debug("Range pin %d %.02f", range->echopin, estimate);
+		return (estimate); // Return distance in inches
 	}
-              // timer pointer
-	timer = (volatile unsigned *)timer_map;
-	++timer;    // timer lo 4 bytes
-		// timer hi 4 bytes available via *(timer+1)
+}
+
+double range_measure(range_t* range, int average)
+{
+	int ping, err = 0;
+
+	range_begin(range);
+	for (ping = 0; !range_done_pinging(range, ping, average); ping++)
+		err = range_ping(range);
 
-	return(0);
+	// Hang out after the last measurement too, as the next one would
+	sleep_until(&range->ready);
+
+	return range_result(range, err);
 }
 
-int TakeMeasurement(unsigned int* feet, unsigned int* inch)
+int range_start(range_t* range, range_done_t done, void* context)
 {
-	unsigned int err;
-	unsigned int timend;
-	unsigned int isrtime;
-	unsigned int measureend;
-	unsigned int inches;
-
-	// Get ready to catch interrupt
-	isr_time_ready = 0;
-	isr_distancetime = 0;
-	isr_risetime = 0;
-	isr_falltime = 0;
-	isr_error = 0;
-	timend = 0;
-	measureend = *timer + MIN_TOTAL_MEASURE_TIME_US;
-
-	// Trigger the transducer for TRIGGER_PULSE_US	
-	digitalWrite(TriggerPin, HIGH);
-	timend = *timer + TRIGGER_PULSE_US;        // TRIGGER_PULSE_US delay
-//	while( (((*timer) - timend) & 0x80000000) != 0);
-	while(*timer < timend) asm("nop");
-	digitalWrite(TriggerPin, LOW);
-	
-	// Wait for interrupt
-	do
-		isrtime = *timer - timend;
-	while ((!isr_time_ready) && (!isr_error) && (isrtime < (TRIGGER_PULSE_US + MAX_DISTANCE_US))); 
-
-	// Check if ISR inicated an isr_error 
-	if (isr_error)
-		err = 2; // No end edge of echo pin
-	
-	// Test if we have a reasonable time
-	else if (isrtime < (TRIGGER_PULSE_US + MAX_DISTANCE_US))
+	struct itimerspec its;
+
+	pthread_mutex_lock(&range->lock);
+	if ((range->state == RANGE_TRIGGERED) || (range->state == RANGE_ECHO))
+	{
+		pthread_mutex_unlock(&range->lock);
+		return -1; // a measurement is already in progress
+	}
+	range->state = RANGE_TRIGGERED;
+	range->done = done;
+	range->context = context;
+
+	clock_gettime(CLOCK_MONOTONIC, &range->deadline);
+	timespec_add_us(&range->deadline, ECHO_TIMEOUT_US);
+	memset(&its, 0, sizeof(its));
+	its.it_value = range->deadline;
+	timer_settime(range->timer, TIMER_ABSTIME, &its, NULL);
+	pthread_mutex_unlock(&range->lock);
+
+	// Trigger the transducer, sleeping through the pulse only makes it longer than the minimum
+	hal_digital_write(range->triggerpin, HAL_HIGH);
+	usleep(TRIGGER_PULSE_US);
+	hal_digital_write(range->triggerpin, HAL_LOW);
+
+	return 0;
+}
+
+int range_wait(range_t* range, unsigned int* echotime)
+{
+	range_done_t done = NULL;
+	void* done_context;
+	int err;
+
+	pthread_mutex_lock(&range->lock);
+	while ((range->state == RANGE_TRIGGERED) || (range->state == RANGE_ECHO))
 	{
-		// Calculate the distance in SAE units
-		inches = isr_distancetime / 148;
-		*feet = inches / 12;
-		*inch = inches % 12;
-		err = 0;
+		// Don't count on the timeout timer's thread being scheduled first
+		if (pthread_cond_timedwait(&range->cond, &range->lock, &range->deadline) == ETIMEDOUT)
+			done = range_expire(range);
 	}
 
-	// We timed out waiting for rising edge of echo pin	
+	if (range->state == RANGE_DONE)
+	{
+		err = range->err;
+		*echotime = range->echotime;
+	}
 	else
-		err = 1; // No start edge of echo pin
+		err = 1; // never started
 
-	// Hang out between measurments to give the transducer time to reset
-	if ((measureend - *timer) > 0)
-		usleep(measureend - *timer);
-	
-	return(err);
+	// Late edges of a finished measurement are ignored
+	done_context = range->context;
+	range->state = RANGE_IDLE;
+	range->done = NULL;
+	pthread_mutex_unlock(&range->lock);
+
+	if (done != NULL)
+		done(done_context, err, 0);
+
+	return err;
 }
 
 /*
  *********************************************************************************
- * interface functions
+ * single instance interface
  *********************************************************************************
  */
 
 int RangeInit(int echopin, int triggerpin, int debug)
 {
-	int err = 0;
-	
-	EchoPin = echopin;
-	TriggerPin = triggerpin;
-	mode_verbose = debug;
-	
-	setup_timer();
-
-	wiringPiISR (EchoPin, INT_EDGE_RISING, &EchoInterrupt) ;
-	pullUpDnControl(EchoPin, PUD_DOWN);
-
-	digitalWrite(TriggerPin, LOW);
-	pinMode(TriggerPin, OUTPUT);
-	
-	return err;
+	return range_init(&range_default, echopin, triggerpin, debug);
 }
 
 double RangeMeasure(int average)
 {
-	unsigned int i, avgcnt;
-	unsigned int feet, inch;
-	int err = 0;
-	unsigned int mode_repeat = 0;
-	double average_val = 0;
-	
-	// Start measurement
-	for (avgcnt = 1; 
-		(avgcnt <= average) /* && (!exitpin_exit) */; 
-		(mode_repeat) ? avgcnt:avgcnt++)
-	{
-		err = TakeMeasurement(&feet, &inch);
-		 	
-		// Check for an err
-		switch(err)
-		{
-			case 0:
-				average_val = ((average_val * (avgcnt - 1)) + ((feet * 12) + inch)) / avgcnt;
-				if (mode_verbose)
-				{
-					printf("Distance: %02i ft, %02i inch, avg: %02.02f", feet, inch, average_val);
-					for (i = 0; i < 40; i++) printf("\b");
-				}
-				break;
-			case 1:
-				if (mode_verbose) 
-				{
-					printf("isr_error: No start pulse              ");
-					for (i = 0; i < 40; i++) printf("\b");
-				}
-				break;
-			case 2:
-				if (mode_verbose)
-				{
-					printf("isr_error: Measurement out of range     "); 
-					for (i = 0; i < 40; i++) printf("\b");
-				}
-				break;
-			default:
-				printf("FUBAR!\n");
-				break;
-		}
-	}
-		
-	// There is no standards here how we return to linux. For this implementation
-	// I will values > 1 as distance in inches, and values < 0 as errors.
-	if (err)
-	{
-		if (mode_verbose)
-			printf("%i\n", err * -1);
-		return (err * -1); // Make errors negative
-	}
-	else
-	{
-		if (mode_verbose)
-			printf("%.02f\n", average_val);
-		return (average_val); // Return distance in inches
-	}
+	return range_measure(&range_default, average);
 }
 
+void RangeSetFilter(int kind, int min_pings, unsigned int tolerance_us)
+{
+	range_set_filter(&range_default, kind, min_pings, tolerance_us);
+}
+
+int RangeStart(range_done_t done, void* context)
+{
+	return range_start(&range_default, done, context);
+}
 
+int RangeWait(unsigned int* echotime)
+{
+	return range_wait(&range_default, echotime);
+}
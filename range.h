@@ -31,9 +31,64 @@
 #ifndef RANGE_H
 #define RANGE_H
 
+#include <pthread.h>
+#include <time.h>
+#include "filter.h"
+
+// Completion callback, err is 0, 1 (no echo start) or 2 (no echo end, or echo too long), echotime in microseconds
+typedef void (*range_done_t)(void* context, int err, unsigned int echotime);
+
+// One HC-S04, its edge callback gets the instance as context
+typedef struct
+{
+	int echopin;
+	int triggerpin;
+	int verbose;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;
+	int err;
+	unsigned int risetime;
+	unsigned int echotime;
+	range_done_t done;
+	void* context;
+	struct timespec ready; // CLOCK_MONOTONIC, the transducer has reset after its last ping
+	struct timespec deadline; // CLOCK_MONOTONIC, the measurement in progress times out
+	timer_t timer;         // calls done at the deadline if the echo never ends
+	filter_t filter;       // pings of the measurement in progress
+} range_t;
+
+int range_init(range_t* range, int echopin, int triggerpin, int debug);
+// Distance in inches estimated from up to average pings, negative if every ping failed
+double range_measure(range_t* range, int average);
+// Estimator used by range_measure (FILTER_* from filter.h), and when it may stop early
+void range_set_filter(range_t* range, int kind, int min_pings, unsigned int tolerance_us);
+/*
+ * A measurement one ping at a time, so pings of several transducers can be
+ * interleaved: range_begin, then range_ping until range_done_pinging, then
+ * range_result. range_ping waits for the transducer to reset from its
+ * previous ping, and returns once the echo ends, 0 or an error as range_wait.
+ */
+void range_begin(range_t* range);
+int range_ping(range_t* range);
+int range_done_pinging(range_t* range, int pings, int average);
+double range_result(range_t* range, int err);
+/*
+ * Asynchronous interface: range_start triggers a ping and returns. The echo
+ * edges are timestamped by interrupt, and done (if not NULL) is called from
+ * the interrupt thread when the echo ends, or from a timer thread with err 1
+ * or 2 if it doesn't end in time. range_wait sleeps until the
+ * measurement completes or times out, returning 0, 1 (no echo start) or
+ * 2 (no echo end, out of range).
+ */
+int range_start(range_t* range, range_done_t done, void* context);
+int range_wait(range_t* range, unsigned int* echotime);
+
+// The same on a single built-in instance
 int RangeInit(int echopin, int triggerpin, int debug);
 double RangeMeasure(int average);
+void RangeSetFilter(int kind, int min_pings, unsigned int tolerance_us);
+int RangeStart(range_done_t done, void* context);
+int RangeWait(unsigned int* echotime);
 
 #endif
-
-
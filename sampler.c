@@ -0,0 +1,160 @@
+/*
+ * sampler.c:
+ *      Adaptive sensor sampling schedule
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "sampler.h"
+
+#define SAMPLES_TO_THRESHOLD 10
+#define FAST_INFLOW_IPM 0.5   // inches per minute, a storm
+#define STABLE_INFLOW_IPM 0.02 // below the ranging noise over a minute
+#define STABLE_SAMPLES 10
+#define STABLE_FACTOR 4
+
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sampler_cond;
+static int base_period;
+static int period;
+static int stable_count;
+static int stopped;
+static int started;
+static struct timespec last_start; // deadline of the last sample
+
+void sampler_init(int base)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sampler_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	base_period = period = (base < SAMPLER_MIN_PERIOD) ? SAMPLER_MIN_PERIOD : base;
+	stable_count = 0;
+	stopped = 0;
+	started = 0;
+}
+
+void sampler_set_period(int base)
+{
+	pthread_mutex_lock(&sampler_lock);
+	base_period = period = (base < SAMPLER_MIN_PERIOD) ? SAMPLER_MIN_PERIOD : base;
+	stable_count = 0;
+	pthread_cond_broadcast(&sampler_cond);
+	pthread_mutex_unlock(&sampler_lock);
+}
+
+int sampler_get_base_period(void)
+{
+	int p;
+
+	pthread_mutex_lock(&sampler_lock);
+	p = base_period;
+	pthread_mutex_unlock(&sampler_lock);
+
+	return p;
+}
+
+int sampler_get_period(void)
+{
+	int p;
+
+	pthread_mutex_lock(&sampler_lock);
+	p = period;
+	pthread_mutex_unlock(&sampler_lock);
+
+	return p;
+}
+
+int sampler_adapt(float distance_in, float inflow_ipm, float threshold_in)
+{
+	float p;
+	int next;
+
+	pthread_mutex_lock(&sampler_lock);
+	p = base_period;
+
+	if ((inflow_ipm < STABLE_INFLOW_IPM) && (inflow_ipm > -STABLE_INFLOW_IPM))
+	{
+		if (stable_count < STABLE_SAMPLES)
+			stable_count++;
+		if (stable_count >= STABLE_SAMPLES)
+			p = base_period * STABLE_FACTOR;
+	}
+	else
+		stable_count = 0;
+
+	if (inflow_ipm >= FAST_INFLOW_IPM)
+		p = SAMPLER_MIN_PERIOD;
+	else if ((inflow_ipm >= STABLE_INFLOW_IPM) && (threshold_in > 0) && (distance_in > threshold_in) &&
+	         ((((distance_in - threshold_in) * 60.0f) / (inflow_ipm * SAMPLES_TO_THRESHOLD)) < p))
+		p = ((distance_in - threshold_in) * 60.0f) / (inflow_ipm * SAMPLES_TO_THRESHOLD);
+
+	next = (p < SAMPLER_MIN_PERIOD) ? SAMPLER_MIN_PERIOD : (int)p;
+	if (next != period)
+	{
+		period = next;
+		pthread_cond_broadcast(&sampler_cond);
+	}
+	pthread_mutex_unlock(&sampler_lock);
+
+	return next;
+}
+
+int sampler_wait(void)
+{
+	struct timespec deadline, now;
+	int err;
+
+	pthread_mutex_lock(&sampler_lock);
+	deadline = last_start;
+	while (!stopped && started)
+	{
+		// Taken again after each wakeup, a new period applies to the sample in progress
+		deadline = last_start;
+		deadline.tv_sec += period;
+		if (pthread_cond_timedwait(&sampler_cond, &sampler_lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!started || ((now.tv_sec - deadline.tv_sec) >= period))
+		last_start = now; // first sample, or too far behind to catch up
+	else
+		last_start = deadline;
+	started = 1;
+	err = stopped ? -1 : 0;
+	pthread_mutex_unlock(&sampler_lock);
+
+	return err;
+}
+
+void sampler_stop(void)
+{
+	pthread_mutex_lock(&sampler_lock);
+	stopped = 1;
+	pthread_cond_broadcast(&sampler_cond);
+	pthread_mutex_unlock(&sampler_lock);
+}
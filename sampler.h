@@ -0,0 +1,53 @@
+/*
+ * sampler.h:
+ *      Adaptive sensor sampling schedule
+ *
+ *	Samples start on absolute CLOCK_MONOTONIC deadlines, so the period
+ *	does not stretch by the time a measurement takes. The period starts
+ *	at the base period set by SETSENSORPERIOD and adapts to the water:
+ *
+ *	- rising, it shrinks so that SAMPLES_TO_THRESHOLD samples are taken
+ *	  before the level reaches the threshold (where the pump starts)
+ *	- rising faster than FAST_INFLOW_IPM, it is the minimum period
+ *	- still for STABLE_SAMPLES samples, it grows to STABLE_FACTOR times
+ *	  the base period
+ *
+ *	A new base period, or sampler_stop, wakes the waiting thread, so it
+ *	applies right away.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#define SAMPLER_MIN_PERIOD 5 // seconds, a range burst and a DHT read with retries fit
+
+void sampler_init(int base_period);
+void sampler_set_period(int base_period);
+int sampler_get_base_period(void);
+int sampler_get_period(void);
+// Pick the next period from the latest level, its rate of rise and the level the pump starts at (0 if unknown)
+int sampler_adapt(float distance_in, float inflow_ipm, float threshold_in);
+// Sleep until the next sample is due, -1 once stopped
+int sampler_wait(void);
+void sampler_stop(void);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * sensors.c:
+ *      Registry of the sensor driver instances
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "hal.h"
+#include "stats.h"
+#include "log.h"
+#include "sensors.h"
+
+#define PING_GUARD_MS 10 // echoes of one transducer die down before the next pings
+
+static sensor_t sensors[SENSORS_MAX];
+static int sensor_count;
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+int sensors_init(const sensor_config_t* config, int debug)
+{
+	sensor_t* sensor;
+	int i;
+
+	for (i = 0; strlen(config[i].name) != 0; i++)
+	{
+		if (sensor_count == SENSORS_MAX)
+		{
+			log_error("Error - more than %d sensors", SENSORS_MAX);
+			return -1;
+		}
+
+		sensor = &sensors[sensor_count];
+		memset(sensor, 0, sizeof(sensor_t));
+		strncpy(sensor->name, config[i].name, SENSOR_NAME_LEN - 1);
+		sensor->kind = config[i].kind;
+		if (sensor->kind == SENSOR_RANGE)
+			range_init(&sensor->driver.range, config[i].pin, config[i].pin2, debug);
+		else if (sensor->kind == SENSOR_DHT)
+			dht_open(&sensor->driver.dht, config[i].pin);
+		else
+			continue;
+		sensor_count++;
+	}
+
+	return 0;
+}
+
+int sensors_count(void)
+{
+	return sensor_count;
+}
+
+sensor_t* sensors_get(int index)
+{
+	return ((index >= 0) && (index < sensor_count)) ? &sensors[index] : NULL;
+}
+
+sensor_t* sensors_find(const char* name)
+{
+	int i;
+
+	for (i = 0; i < sensor_count; i++)
+		if (strcmp(sensors[i].name, name) == 0)
+			return &sensors[i];
+
+	return NULL;
+}
+
+void sensors_measure(int pings, seqlock_t* lock)
+{
+	sensor_t* sensor;
+	int count[SENSORS_MAX];
+	int err[SENSORS_MAX];
+	float distance_in[SENSORS_MAX];
+	float temp_f[SENSORS_MAX], temp_c, humidity_pct[SENSORS_MAX];
+	int i, last, pinging;
+	uint64_t start;
+
+	// Round robin over the range sensors, one ping at a time, until each is done
+	start = stats_now_us();
+	for (i = 0; i < sensor_count; i++)
+	{
+		count[i] = 0;
+		err[i] = 0;
+		if (sensors[i].kind == SENSOR_RANGE)
+			range_begin(&sensors[i].driver.range);
+	}
+	last = -1;
+	do
+	{
+		pinging = 0;
+		for (i = 0; i < sensor_count; i++)
+		{
+			sensor = &sensors[i];
+			if ((sensor->kind != SENSOR_RANGE) || range_done_pinging(&sensor->driver.range, count[i], pings))
+				continue;
+
+			// A transducer's own reset time is longer, range_ping waits for that
+			if ((last >= 0) && (last != i))
+				hal_delay_ms(PING_GUARD_MS);
+			err[i] = range_ping(&sensor->driver.range);
+			count[i]++;
+			last = i;
+			pinging++;
+		}
+	}
+	while (pinging);
+	for (i = 0; i < sensor_count; i++)
+		if (sensors[i].kind == SENSOR_RANGE)
+			distance_in[i] = range_result(&sensors[i].driver.range, err[i]);
+	stats_record(STATS_RANGE, stats_now_us() - start);
+
+	for (i = 0; i < sensor_count; i++)
+	{
+		if (sensors[i].kind != SENSOR_DHT)
+			continue;
+		start = stats_now_us();
+		err[i] = dht_read(&sensors[i].driver.dht, &temp_f[i], &temp_c, &humidity_pct[i]);
+		stats_record(STATS_DHT, stats_now_us() - start);
+	}
+
+	// Publish the new values
+	start = stats_now_us();
+	seqlock_write_begin(lock);
+	stats_record(STATS_LOCK_WAIT, stats_now_us() - start);
+	for (i = 0; i < sensor_count; i++)
+	{
+		sensor = &sensors[i];
+		if (sensor->kind == SENSOR_RANGE)
+		{
+			sensor->distance_in = distance_in[i];
+			sensor->err = (distance_in[i] > 0) ? 0 : -1;
+		}
+		else
+		{
+			sensor->err = err[i];
+			if (err[i] == 0)
+			{
+				sensor->temp_f = temp_f[i];
+				sensor->humidity_pct = humidity_pct[i];
+			}
+		}
+	}
+	seqlock_write_end(lock);
+}
@@ -0,0 +1,81 @@
+/*
+ * sensors.h:
+ *      Registry of the sensor driver instances
+ *
+ *	Every range and DHT sensor is a driver instance registered by name
+ *	from a table, and keeps its last reading here, where command and push
+ *	table entries can point. sensors_measure reads them all. Ultrasonic
+ *	pings are staggered, one transducer at a time with a guard after each
+ *	echo so none hears another's burst, and the pings of the others fill
+ *	each transducer's reset time, so N pits take little longer than one.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include "seqlock.h"
+#include "range.h"
+#include "dht_read.h"
+
+#define SENSORS_MAX 8
+#define SENSOR_NAME_LEN 12
+
+typedef enum
+{
+	SENSOR_NONE,
+	SENSOR_RANGE, // pin is echo, pin2 is trigger
+	SENSOR_DHT
+} sensor_kind_e;
+
+typedef struct
+{
+	char name[SENSOR_NAME_LEN];
+	sensor_kind_e kind;
+	int pin;
+	int pin2;
+} sensor_config_t;
+
+typedef struct
+{
+	char name[SENSOR_NAME_LEN];
+	sensor_kind_e kind;
+	union
+	{
+		range_t range;
+		dht_t dht;
+	} driver;
+	// The last reading, written under the lock given to sensors_measure
+	float distance_in;  // range, negative if every ping failed
+	float temp_f;       // dht, kept from the last good read
+	float humidity_pct;
+	int err;            // 0 if the last read succeeded
+} sensor_t;
+
+// Set up a driver for every entry of a table ending with an empty name
+int sensors_init(const sensor_config_t* config, int debug);
+int sensors_count(void);
+sensor_t* sensors_get(int index);
+sensor_t* sensors_find(const char* name);
+// Read every sensor, each range sensor from up to pings pings, and publish the readings under lock
+void sensors_measure(int pings, seqlock_t* lock);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * seqlock.h:
+ *      Sequence lock for data shared between the sensor thread and the
+ *      transport
+ *
+ *	Writers take a mutex among themselves and bump the sequence number
+ *	around their stores. Readers never block, they copy the data and
+ *	retry if the sequence number was odd or changed while copying.
+ *
+ *	Reader:
+ *		do
+ *		{
+ *			seq = seqlock_read_begin(&lock);
+ *			copy = shared;
+ *		}
+ *		while (seqlock_read_retry(&lock, seq));
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <pthread.h>
+
+typedef struct
+{
+	unsigned int sequence; // odd while a write is in progress
+	pthread_mutex_t writer;
+} seqlock_t;
+
+#define SEQLOCK_INITIALIZER { 0, PTHREAD_MUTEX_INITIALIZER }
+
+static inline int seqlock_init(seqlock_t* sl)
+{
+	sl->sequence = 0;
+	return pthread_mutex_init(&sl->writer, NULL);
+}
+
+static inline void seqlock_destroy(seqlock_t* sl)
+{
+	pthread_mutex_destroy(&sl->writer);
+}
+
+static inline void seqlock_write_begin(seqlock_t* sl)
+{
+	pthread_mutex_lock(&sl->writer);
+	__atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(seqlock_t* sl)
+{
+	__atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sl->writer);
+}
+
+static inline unsigned int seqlock_read_begin(seqlock_t* sl)
+{
+	unsigned int seq;
+
+	// A write only covers a few stores, wait it out rather than sleep
+	while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1);
+
+	return seq;
+}
+
+static inline int seqlock_read_retry(seqlock_t* sl, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&sl->sequence, __ATOMIC_RELAXED) != seq);
+}
+
+#endif
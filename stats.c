@@ -0,0 +1,163 @@
+/*
+ * stats.c:
+ *      Latency histograms
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+#include "timing.h"
+#include "log.h"
+
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS) // buckets per power of 2
+#define STATS_BUCKETS ((32 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct
+{
+	uint32_t count[STATS_BUCKETS];
+	uint32_t max;
+} histogram_t;
+
+static const char* stats_name[STATS_COUNT] =
+{
+	"REQUEST", "PUSH", "RANGE", "DHT", "LOCKWAIT", "PUSHJITTER", "SUBJITTER"
+};
+
+static histogram_t histogram[STATS_COUNT];
+
+/*
+ *********************************************************************************
+ * buckets
+ *********************************************************************************
+ */
+
+// Values below 2 * SUB_COUNT have a bucket each, above that SUB_COUNT buckets per power of 2
+static int bucket_of(uint32_t value)
+{
+	int shift;
+
+	if (value < (2 * SUB_COUNT))
+		return value;
+
+	shift = (31 - __builtin_clz(value)) - SUB_BITS; // value >> shift is in [SUB_COUNT, 2 * SUB_COUNT)
+	return (shift * SUB_COUNT) + (value >> shift);
+}
+
+static uint32_t bucket_top(int bucket)
+{
+	int shift;
+
+	if (bucket < (2 * SUB_COUNT))
+		return bucket;
+
+	shift = (bucket / SUB_COUNT) - 1;
+	return ((uint32_t)((bucket % SUB_COUNT) + SUB_COUNT + 1) << shift) - 1;
+}
+
+static uint32_t percentile(uint32_t* count, uint32_t total, uint32_t max, int pct)
+{
+	uint64_t want, seen = 0;
+	uint32_t top;
+	int i;
+
+	want = (((uint64_t)total * pct) + 99) / 100;
+	for (i = 0; i < STATS_BUCKETS; i++)
+	{
+		seen += count[i];
+		if (seen >= want)
+		{
+			top = bucket_top(i);
+			return (top < max) ? top : max;
+		}
+	}
+
+	return max;
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+uint64_t stats_now_us(void)
+{
+	return timing_us();
+}
+
+void stats_record(stats_id_e id, uint64_t us)
+{
+	histogram_t* h = &histogram[id];
+	uint32_t value = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+	uint32_t max;
+
+	__atomic_fetch_add(&h->count[bucket_of(value)], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while ((value > max) && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+int stats_format(char* out, int size)
+{
+	uint32_t count[STATS_BUCKETS];
+	uint32_t total, max;
+	int id, i, len = 0;
+
+	out[0] = 0;
+	for (id = 0; (id < STATS_COUNT) && (len < size); id++)
+	{
+		// A copy, records keep going while it is summarised
+		total = 0;
+		for (i = 0; i < STATS_BUCKETS; i++)
+		{
+			count[i] = __atomic_load_n(&histogram[id].count[i], __ATOMIC_RELAXED);
+			total += count[i];
+		}
+		max = __atomic_load_n(&histogram[id].max, __ATOMIC_RELAXED);
+
+		len += snprintf(&out[len], size - len, "%s%s=%u,%u,%u,%u,%u", id ? ";" : "", stats_name[id], total,
+		                percentile(count, total, max, 50), percentile(count, total, max, 90),
+		                percentile(count, total, max, 99), max);
+	}
+
+	return (len < size) ? len : size - 1;
+}
+
+void stats_dump(void)
+{
+	char buf[1024];
+	char* entry;
+	char* next;
+
+	stats_format(buf, sizeof(buf));
+
+	// Through the logger, so the SIGUSR1 path never blocks on the output
+	log_info("Stats (count,p50,p90,p99,max us):");
+	for (entry = buf; entry != NULL; entry = next)
+	{
+		next = strchr(entry, ';');
+		if (next != NULL)
+			*next++ = 0;
+		log_info("  %s", entry);
+	}
+}
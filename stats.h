@@ -0,0 +1,53 @@
+/*
+ * stats.h:
+ *      Latency histograms
+ *
+ *	Each histogram counts microsecond durations in log-linear buckets,
+ *	16 per power of 2, so any value is within about 6% and a record is
+ *	an index calculation and an atomic add, from any thread, without a
+ *	lock. Percentiles are reported as the upper edge of their bucket.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+typedef enum {
+	STATS_REQUEST,     // datagram received to response sent
+	STATS_PUSH,        // data_push, serialize and send
+	STATS_RANGE,       // RangeMeasure
+	STATS_DHT,         // dht_read_val, with retries
+	STATS_LOCK_WAIT,   // waiting for the seqlock writer mutex
+	STATS_PUSH_JITTER, // keyframe push period error
+	STATS_SUB_JITTER,  // subscription timer lateness
+	STATS_COUNT
+} stats_id_e;
+
+uint64_t stats_now_us(void); // timing_us(), only differences are meaningful
+void stats_record(stats_id_e id, uint64_t us);
+// NAME=count,p50,p90,p99,max;... all in microseconds
+int stats_format(char* out, int size);
+// One line per histogram on stdout
+void stats_dump(void);
+
+#endif
@@ -27,12 +27,12 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <termios.h>
 #include <pthread.h>
 #include <fcntl.h>
-#include <wiringPi.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <arpa/inet.h>
@@ -41,17 +41,39 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "hal.h"
 #include "beep.h"
-#include "range.h"
-#include "dht_read.h"
+#include "sensors.h"
+#include "history.h"
+#include "journal.h"
+#include "pumpcycle.h"
+#include "sampler.h"
+#include "lifecycle.h"
+#include "stats.h"
+#include "log.h"
+#include "seqlock.h"
 #include "transport.h"
 
 #define BeepPin 2 // Raspberry pi gpio27
 #define EchoPin 7 // Raspberry pi gpio4
 #define TriggerPin 0 // Raspberry pi gpio 17
 #define DHTPin 5 // GPIO 24
+#define SUMP_SENSOR "SUMP" // the sensors the pump metrics, history and journal follow
+#define AIR_SENSOR "AIR"
+#define RANGE_PINGS 5 // most pings a distance is estimated from
+#define PUSHLIST_SIZE 32 // room for the tags of extra sensors
+#define COMMANDLIST_SIZE 64
+#define SENSOR_ID_BASE 64 // binary id of the first extra sensor tag, two per sensor
 
-#define DEFAULT_SENSOR_PERIOD 60 // Seconds
+#define DEFAULT_SENSOR_PERIOD 60 // Seconds, the sampler adapts it to the water level
+#define BEEP_DRAIN_MS 30000 // longest a startup failure waits for its message to finish playing
+#define DEFAULT_HISTORY_COUNT 60 // samples returned by GETHISTORY without an argument
+#define PUMP_DRAIN_THRESHOLD 1.0 // inches the level must fall between samples to count as a pump cycle
+#define JOURNAL_DIR "/var/lib/sump" // SUMP_JOURNAL overrides it
+
+// Journal record types
+#define JOURNAL_SAMPLE 1
+#define JOURNAL_TRANSPORT 2
 
 
 struct sockaddr_in servaddr;
@@ -68,13 +90,30 @@ typedef struct
 	float distance_in;
 	int beeper;
 	char morse[80];
+	pump_stats_t pump;
 } status_t;
 
+typedef struct
+{
+	unsigned int time;
+	float distance_in;
+	float temp_f;
+	float humidity_pct;
+} sample_record_t;
+
+typedef struct
+{
+	unsigned int time;
+	int event;
+	unsigned int value;
+	uint32_t client_addr; // network order, as in sockaddr_in
+	uint16_t client_port;
+	uint16_t reserved;
+} event_record_t;
+
 status_t status;
-int sensor_period = DEFAULT_SENSOR_PERIOD;
 int exitflag = 0;
-int firstsampleflag = 0;
-pthread_mutex_t lock; // sync between UDP thread and main
+seqlock_t lock; // sync between UDP thread and main, readers never block
 commandlist_t command_list;
 void *thread_sensor_sample( void *ptr );
 void measure(void);
@@ -83,30 +122,64 @@ typedef int (*cmdfunc)(char* request, char* response);
 
 int morse(char* request, char* response); 
 int app_exit(char* request, char* response);
+int sensorperiod(char* request, char* response);
+int sampleperiod(char* request, char* response);
+int gethistory(char* request, char* response);
+int gethistoryrange(char* request, char* response);
 
-pushlist_t pushlist[] = { 
-{ "HUMIDITY", TYPE_FLOAT,   &status.humidity_pct}, 
-{ "TEMP",     TYPE_FLOAT,   &status.temp_f}, 
-{ "DISTANCE", TYPE_FLOAT,   &status.distance_in},
-{ "BEEPER",   TYPE_INTEGER, &status.beeper},
-{ "",         TYPE_NULL,    NULL} 
+/*
+ * Sensors beyond the sump and air ones are reported under their own name:
+ * push tag and GET<NAME> for a pit, <NAME>TEMP and <NAME>HUMIDITY for a DHT.
+ */
+sensor_config_t sensor_config[] = {
+//  name           kind           pin        pin2
+{ SUMP_SENSOR,   SENSOR_RANGE,  EchoPin,   TriggerPin},
+{ AIR_SENSOR,    SENSOR_DHT,    DHTPin,    0},
+{ "",            SENSOR_NONE,   0,         0}
 };
+sensor_t* sump_sensor;
+sensor_t* air_sensor;
 
-commandlist_t device_commandlist[] = { 
-{ "GETHUMIDITY",     "HUMIDITY",     NULL,      TYPE_FLOAT,   &status.humidity_pct}, 
-{ "GETTEMP",         "TEMP",         NULL,      TYPE_FLOAT,   &status.temp_f}, 
-{ "GETDISTANCE",     "DISTANCE",     NULL,      TYPE_FLOAT,   &status.distance_in},
-{ "GETBEEPER",       "BEEPER",       NULL,      TYPE_INTEGER, &status.beeper},
-{ "DOMORSE",         "MORSE",        &morse,    TYPE_STRING,  NULL},
-{ "SETSENSORPERIOD", "SENSORPERIOD", NULL,      TYPE_INTEGER, &sensor_period},
-{ "EXIT",            "EXIT",         &app_exit, TYPE_INTEGER, &exitflag},
-{ "",                "",             NULL,      TYPE_NULL,    NULL}
+// Water level changes go out as soon as they are measured, the slow sensors are rate limited
+pushlist_t pushlist[PUSHLIST_SIZE] = { 
+//  tag              type          data                           deadband  min ms  max ms
+{ "HUMIDITY",      TYPE_FLOAT,   &status.humidity_pct,          1.0,      60000,  0}, 
+{ "TEMP",          TYPE_FLOAT,   &status.temp_f,                0.5,      60000,  0}, 
+{ "DISTANCE",      TYPE_FLOAT,   &status.distance_in,           0.2,      0,      0},
+{ "BEEPER",        TYPE_INTEGER, &status.beeper,                0,        0,      0},
+{ "INFLOW",        TYPE_FLOAT,   &status.pump.inflow_ipm,       0.05,     60000,  0},
+{ "PUMPRUNTIME",   TYPE_INTEGER, &status.pump.run_time,         0,        0,      0},
+{ "CYCLESPERHOUR", TYPE_FLOAT,   &status.pump.cycles_per_hour,  0.5,      0,      0},
+{ "SINCECYCLE",    TYPE_INTEGER, &status.pump.since_cycle,      300,      60000,  0},
+{ "DUTYCYCLE",     TYPE_FLOAT,   &status.pump.duty_pct,         1.0,      0,      0},
+{ "",              TYPE_NULL,    NULL,                          0,        0,      0} 
+};
+
+// Binary ids are fixed once published, new commands take new ones
+commandlist_t device_commandlist[COMMANDLIST_SIZE] = { 
+//  request            tag              function          type          data                          id
+{ "GETHUMIDITY",      "HUMIDITY",      NULL,             TYPE_FLOAT,   &status.humidity_pct,         7},
+{ "GETTEMP",          "TEMP",          NULL,             TYPE_FLOAT,   &status.temp_f,               8},
+{ "GETDISTANCE",      "DISTANCE",      NULL,             TYPE_FLOAT,   &status.distance_in,          9},
+{ "GETBEEPER",        "BEEPER",        NULL,             TYPE_INTEGER, &status.beeper,               10},
+{ "GETINFLOW",        "INFLOW",        NULL,             TYPE_FLOAT,   &status.pump.inflow_ipm,      11},
+{ "GETPUMPRUNTIME",   "PUMPRUNTIME",   NULL,             TYPE_INTEGER, &status.pump.run_time,        12},
+{ "GETCYCLESPERHOUR", "CYCLESPERHOUR", NULL,             TYPE_FLOAT,   &status.pump.cycles_per_hour, 13},
+{ "GETSINCECYCLE",    "SINCECYCLE",    NULL,             TYPE_INTEGER, &status.pump.since_cycle,     14},
+{ "GETDUTYCYCLE",     "DUTYCYCLE",     NULL,             TYPE_FLOAT,   &status.pump.duty_pct,        15},
+{ "DOMORSE",          "MORSE",         &morse,           TYPE_STRING,  NULL,                         16},
+{ "SETSENSORPERIOD",  "SENSORPERIOD",  &sensorperiod,    TYPE_INTEGER, NULL,                         17},
+{ "GETSAMPLEPERIOD",  "SAMPLEPERIOD",  &sampleperiod,    TYPE_INTEGER, NULL,                         18},
+{ "GETHISTORY",       "HISTORY",       &gethistory,      TYPE_STRING,  NULL,                         19},
+{ "GETHISTORYRANGE",  "HISTORY",       &gethistoryrange, TYPE_STRING,  NULL,                         20},
+{ "EXIT",             "EXIT",          &app_exit,        TYPE_INTEGER, &exitflag,                    21},
+{ "",                 "",              NULL,             TYPE_NULL,    NULL,                         TP_ID_NONE}
 };
  
 int morse(char* request, char* response) 
 {
 	BeepMorse(5, request);
-	strcpy(response, request);
+	snprintf(response, TP_MAX_RESPONSE, "%s", request);
 	
 	return 0;
 }
@@ -117,17 +190,171 @@ int app_exit(char* request, char* response)
 
 	exitflag = strtol(request, &junk, 0);
 	sprintf(response, "%u", exitflag);
+	if (exitflag)
+		lifecycle_request_exit("EXIT command");
 	
 	return 0;
 }
 
+/*
+ *********************************************************************************
+ * journal
+ *********************************************************************************
+ */
+
+// Runs before any other thread, status and the client sessions to resume are rebuilt without the lock
+void journal_replayed(void* context, int type, const void* payload, int len)
+{
+	const sample_record_t* sample = payload;
+	const event_record_t* event = payload;
+	struct sockaddr_in client;
+
+	if ((type == JOURNAL_SAMPLE) && (len == sizeof(sample_record_t)))
+	{
+		status.distance_in = sample->distance_in;
+		status.temp_f = sample->temp_f;
+		status.humidity_pct = sample->humidity_pct;
+		if (sample->distance_in > 0)
+			pump_update(sample->time, sample->distance_in, &status.pump);
+		history_add(sample->time, sample->distance_in, sample->temp_f, sample->humidity_pct);
+		lifecycle_set_ready();
+	}
+	else if ((type == JOURNAL_TRANSPORT) && (len == sizeof(event_record_t)))
+	{
+		memset(&client, 0, sizeof(client));
+		client.sin_family = AF_INET;
+		client.sin_addr.s_addr = event->client_addr;
+		client.sin_port = event->client_port;
+		tp_restore(event->event, event->value, &client);
+	}
+}
+
+void transport_event(tp_event_e event, unsigned int value, const struct sockaddr_in* client)
+{
+	event_record_t record;
+
+	record.time = time(NULL);
+	record.event = event;
+	record.value = value;
+	record.client_addr = client->sin_addr.s_addr;
+	record.client_port = client->sin_port;
+	record.reserved = 0;
+	journal_append(JOURNAL_TRANSPORT, &record, sizeof(record));
+
+	if (event == TP_EVENT_SHUTDOWN)
+		lifecycle_request_exit("SHUTDOWN command");
+}
+
+// GETHISTORY [count], the newest samples
+int gethistory(char* request, char* response)
+{
+	char* end;
+	long count;
+
+	count = strtol(request, &end, 0);
+	if (end == request)
+		count = DEFAULT_HISTORY_COUNT;
+
+	return history_last((int)count, response, TP_MAX_RESPONSE) < 0;
+}
+
+// GETHISTORYRANGE from[,to], epoch seconds, to defaults to now
+int gethistoryrange(char* request, char* response)
+{
+	char* end;
+	unsigned long from, to;
+
+	from = strtoul(request, &end, 0);
+	if (*end == ',')
+		to = strtoul(end + 1, NULL, 0);
+	else
+		to = time(NULL);
+
+	return history_range(from, to, response, TP_MAX_RESPONSE) < 0;
+}
+
+// SETSENSORPERIOD [seconds], the base sample period, applied right away
+int sensorperiod(char* request, char* response)
+{
+	char* end;
+	long period;
+
+	period = strtol(request, &end, 0);
+	if (end != request)
+		sampler_set_period((int)period);
+	sprintf(response, "%d", sampler_get_base_period());
+
+	return 0;
+}
+
+// GETSAMPLEPERIOD, the period the sampler picked for the current conditions
+int sampleperiod(char* request, char* response)
+{
+	sprintf(response, "%d", sampler_get_period());
+
+	return 0;
+}
+
+// Append a push entry and a GET command for a reading of an extra sensor
+static void add_sensor_tag(const char* name, const char* suffix, float* data, float deadband, unsigned int min_interval_ms, int id)
+{
+	int p, c;
+
+	for (p = 0; strlen(pushlist[p].tag) != 0; p++);
+	for (c = 0; strlen(device_commandlist[c].request) != 0; c++);
+	if ((p >= (PUSHLIST_SIZE - 1)) || (c >= (COMMANDLIST_SIZE - 1)))
+	{
+		log_error("Error - no room for the tags of sensor %s", name);
+		return;
+	}
+	if ((strlen(name) + strlen(suffix)) > 16) // GET<tag> fits a request
+	{
+		log_error("Error - sensor tag %s%s is too long", name, suffix);
+		return;
+	}
+
+	strcpy(pushlist[p].tag, name);
+	strcat(pushlist[p].tag, suffix);
+	pushlist[p].data_type = TYPE_FLOAT;
+	pushlist[p].data = data;
+	pushlist[p].deadband = deadband;
+	pushlist[p].min_interval_ms = min_interval_ms;
+
+	strcpy(device_commandlist[c].request, "GET");
+	strcat(device_commandlist[c].request, pushlist[p].tag);
+	strcpy(device_commandlist[c].tag, pushlist[p].tag);
+	device_commandlist[c].data_type = TYPE_FLOAT;
+	device_commandlist[c].data = data;
+	device_commandlist[c].id = id;
+}
+
+static void add_sensor_tags(void)
+{
+	sensor_t* sensor;
+	int i;
+
+	for (i = 0; i < sensors_count(); i++)
+	{
+		sensor = sensors_get(i);
+		if ((sensor == sump_sensor) || (sensor == air_sensor))
+			continue;
+		// The ids follow the sensor's place in the list, so they stay put as sensors are added after it
+		if (sensor->kind == SENSOR_RANGE)
+			add_sensor_tag(sensor->name, "", &sensor->distance_in, 0.2, 0, SENSOR_ID_BASE + (2 * i));
+		else
+		{
+			add_sensor_tag(sensor->name, "TEMP", &sensor->temp_f, 0.5, 60000, SENSOR_ID_BASE + (2 * i));
+			add_sensor_tag(sensor->name, "HUMIDITY", &sensor->humidity_pct, 1.0, 60000, SENSOR_ID_BASE + (2 * i) + 1);
+		}
+	}
+}
+
 void *thread_sensor_sample( void *ptr ) 
 {
 	
-	while (!exitflag)
+	while (!exitflag && (sampler_wait() == 0))
 	{
 		measure();
-		sleep(sensor_period);
 	}
 	
 	return NULL;
@@ -135,18 +362,47 @@ void *thread_sensor_sample( void *ptr )
 
 void measure( void )
 {
-	float temp_c;
+	float distance_in;
+	sample_record_t sample;
+	pump_stats_t pump;
+	uint64_t start;
 
-	// Fetch sensor data
-	pthread_mutex_lock(&lock);
-	status.distance_in = RangeMeasure(5);
-	pthread_mutex_unlock(&lock);
-		
-	pthread_mutex_lock(&lock);
-	dht_read_val(&status.temp_f, &temp_c, &status.humidity_pct);
-	
-	firstsampleflag = 1;
-	pthread_mutex_unlock(&lock);
+	// Fetch sensor data, this takes a while so nothing is held. Only this thread writes the sensor readings.
+	sensors_measure(RANGE_PINGS, &lock);
+	distance_in = sump_sensor->distance_in;
+	sample.time = time(NULL);
+
+	if (distance_in > 0)
+		pump_update(sample.time, distance_in, &pump);
+
+	// Publish the new values. GET* commands with an argument write status from the
+	// transport thread, so it's only read here inside the write section too.
+	start = stats_now_us();
+	seqlock_write_begin(&lock);
+	stats_record(STATS_LOCK_WAIT, stats_now_us() - start);
+	status.distance_in = distance_in;
+	if (air_sensor->err == 0)
+	{
+		status.temp_f = air_sensor->temp_f;
+		status.humidity_pct = air_sensor->humidity_pct;
+	}
+	if (distance_in > 0)
+		status.pump = pump;
+	else
+		pump = status.pump;
+	sample.distance_in = status.distance_in;
+	sample.temp_f = status.temp_f;
+	sample.humidity_pct = status.humidity_pct;
+	seqlock_write_end(&lock);
+	lifecycle_set_ready();
+
+	if (distance_in > 0)
+		sampler_adapt(distance_in, pump.inflow_ipm, pump.start_distance);
+
+	history_add(sample.time, sample.distance_in, sample.temp_f, sample.humidity_pct);
+	journal_append(JOURNAL_SAMPLE, &sample, sizeof(sample));
+
+	tp_force_data_push();
 }
 
 /*
@@ -160,11 +416,29 @@ int  main(void)
 	int  iret1;
 	int broadcast;
 	pthread_t sensor_sample;
+	char* journaldir;
+	int i;
+
+	// Before any thread starts, they all inherit its signal mask
+	if (lifecycle_init())
+		exit(1);
+	log_open(getenv("SUMP_LOG")); // stderr unless set
+	log_info("Sump Launch...");
+	lifecycle_set_usr1_handler(stats_dump);
 
-	printf("Sump Launch...\r\n");
 	// Setup GPIO's, Timers, Interrupts, etc
-	if (wiringPiSetup() == -1)
+	if (hal_setup(NULL) == -1)
 		exit(1);
+	if (hal == &hal_sim_backend)
+	{
+		for (i = 0; strlen(sensor_config[i].name) != 0; i++)
+		{
+			if (sensor_config[i].kind == SENSOR_RANGE)
+				hal_sim_attach_range(sensor_config[i].pin, sensor_config[i].pin2);
+			else if (sensor_config[i].kind == SENSOR_DHT)
+				hal_sim_attach_dht(sensor_config[i].pin);
+		}
+	}
 	/* Set up the socket */
 	rtiUdpPort = RTI_UDP_PORT;
 	broadcast = 1;
@@ -177,49 +451,77 @@ int  main(void)
 
 	// Initialize sensors
 	BeepInit(BeepPin, 0);
-	RangeInit(EchoPin, TriggerPin, 1);
-	dht_init(DHTPin);
+	sensors_init(sensor_config, 1);
+	sump_sensor = sensors_find(SUMP_SENSOR);
+	air_sensor = sensors_find(AIR_SENSOR);
+	if ((sump_sensor == NULL) || (air_sensor == NULL))
+	{
+		log_error("Error - no %s or %s sensor", SUMP_SENSOR, AIR_SENSOR);
+		log_close();
+		return -1;
+	}
+	add_sensor_tags();
 	
-	iret1 = pthread_mutex_init(&lock, NULL); 
+	iret1 = seqlock_init(&lock); 
 	if(iret1)
 	{
 		BeepMorse(5, "Mutex Fail");
-		printf("Error - mutex init failed, return code: %d\n",iret1);
+		log_error("Error - mutex init failed, return code: %d",iret1);
+		BeepDrain(BEEP_DRAIN_MS);
+		log_close();
 		return -1;
 	}
 
+	pump_init(PUMP_DRAIN_THRESHOLD);
+
+	// Pick up where the last run left off, a sample found there is served right away
+	journaldir = getenv("SUMP_JOURNAL");
+	if (journal_open((journaldir != NULL) ? journaldir : JOURNAL_DIR, journal_replayed, NULL))
+		log_warn("Running without a journal");
+	tp_set_event_handler(transport_event);
+
+	sampler_init(DEFAULT_SENSOR_PERIOD);
+
 	/* Initialize the threads */
 	iret1 = pthread_create( &sensor_sample, NULL, thread_sensor_sample, NULL);
 	if(iret1)
 	{
-		printf("Error - pthread_create() return code: %d\n",iret1);
+		log_error("Error - pthread_create() return code: %d",iret1);
 		BeepMorse(5, "thread_sensor_sample Thread Create Fail");
+		BeepDrain(BEEP_DRAIN_MS);
+		log_close();
 		return -2;
 	}
 	else
-		printf("Launching thread sensor_sample\r\n");
+		log_info("Launching thread sensor_sample");
 
-	// wait until we have our first sample
-	while(!firstsampleflag);
-	
-	tp_handle_requests(device_commandlist, &lock);
-	
-	tp_handle_data_push(pushlist, &lock);
+	// Serve once there is a sample, from the journal or freshly taken
+	if (lifecycle_wait_ready() == 0)
+	{
+		tp_handle_requests(device_commandlist, &lock);
+		
+		tp_handle_data_push(pushlist, &lock);
 
-	BeepMorse(5, "OK");
-	
-	while (!exitflag) sleep(0);
+		BeepMorse(5, "OK");
+		
+		lifecycle_wait_exit();
+	}
 	
-	printf("Sump Exit Set...\r\n");
+	log_info("Sump Exit Set...");
 	
 	// Exit	
 	tp_stop_handlers();
-	pthread_join(sensor_sample, NULL);
-	pthread_mutex_destroy(&lock);
+	sampler_stop();
+	if (lifecycle_join(sensor_sample, "sensor_sample") == 0)
+		seqlock_destroy(&lock); // nothing writes it any more
+	journal_close();
 
+	// Whatever is still queued is dropped, and "Exit" only plays out within the shutdown budget
+	BeepCancel();
 	BeepMorse(5, "Exit");
-	
-	while(1);
+	BeepDrain(lifecycle_remaining_ms());
+	BeepStop();
+	log_close();
 	
 	return 0;
 }
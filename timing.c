@@ -0,0 +1,186 @@
+/*
+ * timing.c:
+ *      64-bit monotonic microsecond clock
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#define _FILE_OFFSET_BITS 64 // the BCM2711 peripherals are above 2GB, past a 32 bit off_t
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "log.h"
+#include "timing.h"
+
+#define DT_COMPATIBLE "/proc/device-tree/compatible"
+#define DT_SOC_RANGES "/proc/device-tree/soc/ranges"
+#define ST_OFFSET 0x3000 // system timer registers from the peripheral base
+#define ST_MAP_SIZE 4096
+
+typedef struct
+{
+	const char* compatible;
+	const char* name;
+	uint32_t peri_base; // used if the device tree has no soc ranges
+} soc_t;
+
+static const soc_t soc_table[] =
+{
+	{ "brcm,bcm2835", "BCM2835", 0x20000000 }, // Pi 1, Zero
+	{ "brcm,bcm2836", "BCM2836", 0x3F000000 }, // Pi 2
+	{ "brcm,bcm2837", "BCM2837", 0x3F000000 }, // Pi 3, Zero 2
+	{ "brcm,bcm2711", "BCM2711", 0xFE000000 }, // Pi 4, 400, CM4
+	{ NULL, NULL, 0 }
+};
+
+const volatile uint32_t* timing_st = NULL;
+static char source[32] = "CLOCK_MONOTONIC_RAW";
+
+/*
+ *********************************************************************************
+ * support functions
+ *********************************************************************************
+ */
+
+static int read_file(const char* path, unsigned char* buf, int size)
+{
+	int fd, len;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size);
+	close(fd);
+
+	return len;
+}
+
+// The compatible property is a list of NUL terminated strings, most specific first
+static const soc_t* find_soc(void)
+{
+	unsigned char compatible[256];
+	const soc_t* soc;
+	int len, i;
+
+	len = read_file(DT_COMPATIBLE, compatible, sizeof(compatible) - 1);
+	if (len <= 0)
+		return NULL;
+	compatible[len] = 0;
+
+	for (i = 0; i < len; i += strlen((char*)&compatible[i]) + 1)
+	{
+		for (soc = soc_table; soc->compatible != NULL; soc++)
+		{
+			if (strcmp((char*)&compatible[i], soc->compatible) == 0)
+				return soc;
+		}
+	}
+
+	return NULL;
+}
+
+static uint32_t be32(const unsigned char* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// The first soc range maps bus address 0x7E000000 to the peripheral base,
+// one cell wide on the older SoCs and two (high word 0) on the BCM2711
+static uint32_t peripheral_base(const soc_t* soc)
+{
+	unsigned char ranges[12];
+	uint32_t base;
+	int len;
+
+	len = read_file(DT_SOC_RANGES, ranges, sizeof(ranges));
+	if (len < 8)
+		return soc->peri_base;
+
+	base = be32(&ranges[4]);
+	if ((base == 0) && (len >= 12))
+		base = be32(&ranges[8]);
+
+	return (base != 0) ? base : soc->peri_base;
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+uint64_t timing_clock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+const char* timing_source(void)
+{
+	return source;
+}
+
+int timing_init(void)
+{
+	const soc_t* soc;
+	uint32_t base;
+	void* map;
+	int memfd;
+
+	if (timing_st != NULL)
+		return 0;
+
+	soc = find_soc();
+	if (soc == NULL)
+	{
+		log_info("Clock: no known Pi SoC, using %s", source);
+		return -1;
+	}
+	base = peripheral_base(soc);
+
+	memfd = open("/dev/mem", O_RDONLY | O_SYNC);
+	if (memfd < 0)
+	{
+		log_warn("Clock: %s /dev/mem open failed: %i, using %s", soc->name, errno, source);
+		return -1;
+	}
+
+	map = mmap(NULL, ST_MAP_SIZE, PROT_READ, MAP_SHARED, memfd, (off_t)base + ST_OFFSET);
+	close(memfd);
+	if (map == MAP_FAILED)
+	{
+		log_warn("Clock: %s system timer map failed: %i, using %s", soc->name, errno, source);
+		return -1;
+	}
+
+	snprintf(source, sizeof(source), "%s system timer", soc->name);
+	timing_st = map;
+	log_info("Clock: %s at 0x%08x", source, base + ST_OFFSET);
+
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * timing.h:
+ *      64-bit monotonic microsecond clock
+ *
+ *	On a Raspberry Pi the SoC is identified at run time from the device
+ *	tree and its free running 1MHz system timer is mapped from /dev/mem,
+ *	so a clock read is two or three loads with no system call. The timer
+ *	counts in 64 bits, CHI is re-read around CLO so a carry between the
+ *	two halves is never torn. Without /dev/mem access (not root, not a
+ *	Pi, or a Pi 5 whose timer is not at a fixed address) the clock is
+ *	CLOCK_MONOTONIC_RAW, which the vDSO serves without a system call too.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+#define TIMING_ST_CLO 1 // system timer counter low word, in 32 bit registers
+#define TIMING_ST_CHI 2 // and high word
+
+extern const volatile uint32_t* timing_st; // mapped system timer, NULL if not in use
+
+// Map the system timer when running on a known Pi, otherwise use the fallback.
+// The clock can be read before, it uses the fallback until then.
+int timing_init(void);
+// "BCM2711 system timer" or "CLOCK_MONOTONIC_RAW"
+const char* timing_source(void);
+uint64_t timing_clock_us(void); // the fallback
+
+static inline uint64_t timing_us(void)
+{
+	uint32_t hi, lo;
+
+	if (timing_st == NULL)
+		return timing_clock_us();
+
+	do
+	{
+		hi = timing_st[TIMING_ST_CHI];
+		lo = timing_st[TIMING_ST_CLO];
+	}
+	while (hi != timing_st[TIMING_ST_CHI]);
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// Low 32 bits only, one load on a Pi. Wraps every 71 minutes, so only
+// compare two readings by their unsigned difference.
+static inline uint32_t timing_us32(void)
+{
+	if (timing_st == NULL)
+		return (uint32_t)timing_clock_us();
+
+	return timing_st[TIMING_ST_CLO];
+}
+
+#endif
@@ -23,10 +23,12 @@
  ***********************************************************************
  */
 
+#define _GNU_SOURCE // sendmmsg
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <termios.h>
@@ -34,341 +36,1822 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <time.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <ifaddrs.h>
+#include "seqlock.h"
 #include "transport.h"
+#include "stats.h"
+#include "fmt.h"
+#include "frame.h"
+#include "log.h"
+#include "wheel.h"
 #include <limits.h>
 
 #define PAIR_PERIOD 30
 #define DEFAULT_PUSH_PERIOD 300 // Seconds
+#define MAX_EVENTS 8
+#define MAX_COMMANDS 100
+#define CMD_HASH_SIZE 256 // power of 2, well above MAX_COMMANDS so a perfect seed is found quickly
+#define CMD_SEPARATORS " =\r\n\t"
+#define MAX_BATCH 16 // commands in one text request, one per line
+#define PUSH_MTU 1472 // UDP payload that fits a 1500 byte ethernet frame
+#define MAX_PUSH_FRAMES 8
+#define MAX_SESSIONS 8
+#define SESSION_IDLE_S 120 // an unpaired session is dropped this long after its last request
+#define MAX_SELF_ADDRS 16 // local IPv4 addresses kept to recognise our own broadcasts
+#define SELF_ADDRS_REFRESH_S 300 // they are read again this often, or at the next push timer after a failure
+#define SESSION_PAIRED_IDLE_S 3600 // a paired one, with no request or push, is sent PAIR=0, so it pairs again if it is still there
+#define MAX_PUSH_TAGS 32
+#define MAX_STRING_VALUE TP_MAX_STRING
+#define SUBSCRIBE_TICK_US 1000000 // subscription rates are whole seconds, one wheel tick each
+#define TAG_MAX 19 // tags are char[20]
+#define PREFIX_MAX 24 // "TAG="
+#define ENTRY_MAX (PREFIX_MAX + MAX_STRING_VALUE + FMT_FIXED1_LEN) // longest "TAG=value\r\n"
 
-typedef struct transport
+// A variable copied out of the shared data, so it can be formatted without holding anything
+typedef struct
+{
+	data_type_e type;
+	union
+	{
+		unsigned int u;
+		float f;
+		char s[MAX_STRING_VALUE];
+	} v;
+} tp_value_t;
+
+// "TAG=" built once, so formatting a value is a copy and an append
+typedef struct
+{
+	int len;
+	char text[PREFIX_MAX];
+} tp_prefix_t;
+
+typedef struct
+{
+	int len;
+	char data[PUSH_MTU];
+} push_frame_t;
+
+// What the processor was last sent for a pushlist entry
+typedef struct
 {
+	tp_value_t value;
+	uint64_t sent_ms;
+} push_state_t;
+
+struct session;
+
+// A tag a session has subscribed to at its own rate
+typedef struct
+{
+	wheel_timer_t timer; // first, an expired timer is its subscription
+	struct session* session;
+	int tag;              // pushlist index
+	unsigned int rate_s;
+} subscription_t;
+
+// A client, found by its source address. Pushes go to the paired ones.
+typedef struct session
+{
+	struct sockaddr_in addr;
+	int in_use;
 	int paired;
+	int push_period;
 	unsigned int sequencenumber;
+	uint32_t subscribed;  // bit i set if pushlist entry i is pushed on change, and in keyframes
+	uint32_t rated;       // bit i set if it is pushed at its own rate instead
+	uint32_t pending;     // bit i set if it goes out with the next push, whether it changed or not
+	int custom;           // 0 while subscribed to every tag, as a new session is
+	uint64_t last_us;     // last request, or push sent, CLOCK_MONOTONIC
+	uint64_t keyframe_us; // next keyframe, 0 if it is due right away
+	push_state_t push_state[MAX_PUSH_TAGS];
+	subscription_t subscription[MAX_PUSH_TAGS];
+} session_t;
+
+typedef struct transport
+{
 	int exit;
-	int push_period;
+	int push_period;             // of a new session
 } transport_t;    
 
-void *thread_data_push(void *ptr);
-void *thread_request_handler(void *ptr);
-void data_push(pushlist_t* pushlist);
+// What a client's session had reached in a previous run
+typedef struct
+{
+	struct sockaddr_in addr;
+	int in_use;
+	unsigned int sequencenumber;
+	int push_period;
+} restored_t;
+
+void *thread_event_loop(void *ptr);
+void handle_request(int fd);
+void data_push(session_t* only);
+int push_serialize(session_t* session, tp_value_t* values, int count, uint32_t force, uint64_t now, push_frame_t* frames);
+int push_send(struct mmsghdr* msgs, int n);
 int pair(char* request, char* response);
+int setpushperiod(char* request, char* response);
+int subscribe(char* request, char* response);
+int unsubscribe(char* request, char* response);
+static void session_subscribe(session_t* s, int tag, unsigned int rate_s);
+static void session_unsubscribe(session_t* s, int tag);
+static void session_subscribe_all(session_t* s);
+static void session_pair(session_t* s, int paired);
+static uint64_t now_us(void);
+static int push_snapshot(tp_value_t* values);
+static const char* session_name(session_t* s);
 int sendupdate(char* request, char* response);
+int getstats(char* request, char* response);
+int getids(char* request, char* response);
+int getall(char* request, char* response);
 
-struct sockaddr_in cliaddr, alladdr;
-static pthread_t request_thread, push_thread;
+struct sockaddr_in alladdr;
+static pthread_t loop_thread;
+static pthread_once_t loop_once = PTHREAD_ONCE_INIT;
 static transport_t transport;
 static pushlist_t* pushlist;
-static pthread_mutex_t req_lock; 
-static pthread_mutex_t push_lock;
-static pthread_cond_t cond  = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static seqlock_t* req_lock; 
+static seqlock_t* push_lock;
+static int epfd = -1;   // epoll set: request sockets, push timer, wakeup event
+static int timerfd = -1; // push period, or pairing broadcast period while un-paired
+static int deltafd = -1; // next min_interval or max_interval deadline of a pushlist entry
+static int wakefd = -1;  // tp_force_data_push and tp_stop_handlers wakeups
+static volatile int force_push = 0;
+static push_frame_t push_frames[MAX_SESSIONS * MAX_PUSH_FRAMES]; // only touched from the event loop
+static session_t sessions[MAX_SESSIONS];  // likewise
+static session_t transient;               // answers a client that found every session paired
+static session_t* session;                // the session of the request being run
+static volatile int paired_count;
+static uint64_t pair_broadcast_us;        // next PAIR=0 broadcast while no session is paired
+static restored_t restored[MAX_SESSIONS]; // taken by the client's first new session
+static int restored_next;                 // the entry a client that doesn't fit replaces
+static wheel_t wheel;                     // subscription rates, ticks of SUBSCRIBE_TICK_US
+static uint64_t wheel_start_us;           // tick 0
+static in_addr_t self_addrs[MAX_SELF_ADDRS]; // local interface addresses
+static int self_count = -1;               // -1 until they are read
+static uint64_t self_refresh_us;          // when they are read again
+static tp_event_t event_handler;
+static tp_prefix_t cmd_prefix[MAX_COMMANDS];
+static tp_prefix_t push_prefix[MAX_PUSH_TAGS];
+static tp_prefix_t seq_prefix;
+static int push_id[MAX_PUSH_TAGS]; // binary id of each pushlist entry, -1 if it has none
+static int command_count;
 
 extern int sockfd;
 extern int rtiUdpPort;
 
-commandlist_t commandlist[100]; // keep simple, statically allocate 100 possible commands
+commandlist_t commandlist[MAX_COMMANDS]; // keep simple, statically allocate 100 possible commands
+static unsigned char cmd_index[CMD_HASH_SIZE]; // hash slot -> commandlist index + 1, 0 is empty
+static unsigned char id_index[256];           // binary frame id -> commandlist index + 1, 0 is none
+static unsigned char cmd_len[MAX_COMMANDS];
+static unsigned int cmd_seed;
 int req_err = 0;
 int push_err = 0;
 
-commandlist_t sequence_number = 
-{ "",        "SEQUENCENUMBER",       NULL, TYPE_INTEGER, &transport.sequencenumber};
+commandlist_t sequence_number = // only the tag, every session has its own
+{ "",        "SEQUENCENUMBER",       NULL, TYPE_INTEGER, NULL, TP_ID_NONE};
 
 #define PAIR_COMMAND 0 // this is needed to advertise the need to pair
 commandlist_t transport_commands[] = { 
-{ "SETPAIR",         "PAIR",         &pair, TYPE_INTEGER, NULL},
-{ "SHUTDOWN",        "SHUTDOWN",     NULL, TYPE_INTEGER, &transport.exit},
-{ "SETPUSHPERIOD",   "PUSHPERIOD",   NULL, TYPE_INTEGER, &transport.push_period},
-{ "SENDUPDATE",      "UPDATE",       &sendupdate, TYPE_INTEGER, NULL},
-{ "",                "",             NULL, TYPE_NULL,    NULL} 
+{ "SETPAIR",         "PAIR",         &pair, TYPE_INTEGER, NULL, 0},
+{ "SHUTDOWN",        "SHUTDOWN",     NULL, TYPE_INTEGER, &transport.exit, 1},
+{ "SETPUSHPERIOD",   "PUSHPERIOD",   &setpushperiod, TYPE_INTEGER, NULL, 2},
+{ "SENDUPDATE",      "UPDATE",       &sendupdate, TYPE_INTEGER, NULL, 3},
+{ "GETSTATS",        "STATS",        &getstats, TYPE_STRING, NULL, 4},
+{ "SETLOGLEVEL",     "LOGLEVEL",     NULL, TYPE_INTEGER, &log_level, 5},
+{ "GETIDS",          "IDS",          &getids, TYPE_STRING, NULL, 6},
+{ "GETALL",          "ALL",          &getall, TYPE_LINES, NULL, 240},
+{ "SUBSCRIBE",       "SUBSCRIBE",    &subscribe, TYPE_STRING, NULL, 241},
+{ "UNSUBSCRIBE",     "UNSUBSCRIBE",  &unsubscribe, TYPE_STRING, NULL, 242},
+{ "",                "",             NULL, TYPE_NULL,    NULL, TP_ID_NONE} 
 };
 
 int sendupdate(char* request, char* response)
 {
-	sprintf(response, "1");
-	data_push(pushlist);
+	response[fmt_uint(response, 1)] = 0;
+	data_push(session);
 	
 	return 0;
 }
 
+int getstats(char* request, char* response)
+{
+	stats_format(response, TP_MAX_RESPONSE);
+
+	return 0;
+}
+
+// "NAME:id" for every command a binary request can reach
+int getids(char* request, char* response)
+{
+	int i, n, len = 0;
+
+	response[0] = 0;
+	for (i = 0; i < command_count; i++)
+	{
+		if (commandlist[i].id == TP_ID_NONE)
+			continue;
+		n = snprintf(&response[len], TP_MAX_RESPONSE - len, len ? ",%s:%d" : "%s:%d", commandlist[i].request, commandlist[i].id);
+		if (n >= (TP_MAX_RESPONSE - len))
+		{
+			// Cut at the last whole name, rather than run off the buffer
+			response[len] = 0;
+			log_warn("GETIDS truncated at %d of %d commands", i, command_count);
+			break;
+		}
+		len += n;
+	}
+
+	return 0;
+}
+
 int pair(char* request, char* response)
 {
 	char* junk;
+	int paired;
 
-	printf("pair request=%s,reqlen=%d\r\n", request, strlen(request));
-	transport.paired = strtol(request, &junk, 0);
-	sprintf(response, "%u", transport.paired);
+	paired = strtol(request, &junk, 0);
+	if (session == &transient)
+	{
+		log_warn("Every session is paired, %s can not pair", session_name(session));
+		paired = 0;
+	}
+	session_pair(session, paired);
+	response[fmt_uint(response, session->paired)] = 0;
 	
-	if (transport.paired)
-		printf("Paired with %s\r\n", inet_ntoa(cliaddr.sin_addr));
+	if (session->paired)
+		log_info("Paired with %s%s", session_name(session), (session->paired == TP_PAIR_BINARY) ? ", binary" : "");
 	else
-		printf("Un-paired\r\n");
+		log_info("Un-paired %s", session_name(session));
 	
-	printf("pair request=%s,reqlen=%d,response=%s\n", request, strlen(request), response);
 	return 0;
 }
 
-void tp_stop_handlers()
+// The next keyframe of a paired session moves to one new period from now
+int setpushperiod(char* request, char* response)
 {
-	int sockfd;
-	char sendmesg[200] = {0};
+	char* junk;
+	int period;
 
-	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	period = strtol(request, &junk, 0);
+	if ((junk != request) && (period > 0) && (period != session->push_period))
+	{
+		session->push_period = period;
+		if (session->paired)
+			session->keyframe_us = now_us() + (period * 1000000ULL);
+	}
+	response[fmt_uint(response, session->push_period)] = 0;
 
-	sprintf(sendmesg, "PAIR=0\r\n");
-	sendto(sockfd, sendmesg, sizeof(sendmesg), 0, (struct sockaddr *)&alladdr, sizeof(alladdr));
-	
-	transport.exit = 1;
-	pthread_join(request_thread, NULL);
-	pthread_join(push_thread, NULL);
+	return 0;
 }
 
-int tp_handle_requests(commandlist_t* device_commandlist, pthread_mutex_t* lock)
+// The pushlist index of the tag that starts request, -1 if it is not pushed
+static int push_tag(const char* request, int len)
 {
-	int i, j;
-	int err;
+	int i;
 
-	// merge device command list, and transport command list
-	i = 0;
-	while(strlen(transport_commands[i].request) != 0)
+	for (i = 0; (pushlist != NULL) && (i < MAX_PUSH_TAGS) && (pushlist[i].tag[0] != 0); i++)
 	{
-		memcpy((void*)&(commandlist[i]), (void*)&(transport_commands[i]), sizeof(commandlist_t));
-		i++;
+		if ((strlen(pushlist[i].tag) == (size_t)len) && !strncmp(pushlist[i].tag, request, len))
+			return i;
 	}
+	return -1;
+}
 
-	j = 0;
-	while(strlen(device_commandlist[j].request) != 0)
+// "TAG[,seconds]", pushed every so many seconds, or on change without them.
+// "ALL" goes back to every tag on change, as a new session starts.
+int subscribe(char* request, char* response)
+{
+	char* junk;
+	unsigned int rate_s = 0;
+	int len, tag;
+
+	len = strcspn(request, ", ");
+	if ((len == 3) && !strncmp(request, "ALL", 3) && (session != &transient))
 	{
-		memcpy((void*)&(commandlist[i]), (void*)&(device_commandlist[j]), sizeof(commandlist_t));
-		i++;
-		j++;
+		session_subscribe_all(session);
+		strcpy(response, "ALL");
+		return 0;
 	}
-    
-	err = pthread_create( &request_thread, NULL, thread_request_handler, (void*)&commandlist);
-	if(err)
+
+	tag = push_tag(request, len);
+	if ((tag < 0) || (session == &transient))
 	{
-		printf("Error - pthread_create() fail\r\n");
-		return -1;
+		strcpy(response, "-1");
+		return 0;
 	}
+	if (request[len] != 0)
+		rate_s = strtoul(&request[len + 1], &junk, 0);
+
+	session_subscribe(session, tag, rate_s);
+	snprintf(response, TP_MAX_RESPONSE, rate_s ? "%s,%u" : "%s", pushlist[tag].tag, rate_s);
+
+	return 0;
+}
+
+// "TAG", or "ALL" for no pushes at all
+int unsubscribe(char* request, char* response)
+{
+	int len, tag;
+
+	len = strcspn(request, ", ");
+	if ((len == 3) && !strncmp(request, "ALL", 3))
+		tag = MAX_PUSH_TAGS;
 	else
+		tag = push_tag(request, len);
+	if ((tag < 0) || (session == &transient))
 	{
-		printf("Launching thread request_handler\r\n");
+		strcpy(response, "-1");
+		return 0;
 	}
-	
-	req_lock = *lock;
-	
-	return req_err;
+
+	session_unsubscribe(session, tag);
+	strcpy(response, (tag == MAX_PUSH_TAGS) ? "ALL" : pushlist[tag].tag);
+
+	return 0;
 }
 
-void *thread_request_handler(void *ptr) 
+/*
+ *********************************************************************************
+ * values
+ *********************************************************************************
+ */
+
+// Call inside a seqlock read section, the copy is discarded if a write raced it
+static void value_copy(tp_value_t* value, data_type_e type, void* data)
 {
-	commandlist_t* command_list;
-	int n, i;
-	char* junk;
-	socklen_t len;
-	char mesg[100];
-	char sendmesg[200] = {0};
-	char commandfuncdata[100];
-	
-	command_list = (commandlist_t*)ptr;
+	value->type = type;
+	switch (type)
+	{
+		case TYPE_INTEGER:
+			value->v.u = *(unsigned int*)data;
+			break;
+		case TYPE_FLOAT:
+			value->v.f = *(float*)data;
+			break;
+		case TYPE_STRING:
+			strncpy(value->v.s, (char*)data, MAX_STRING_VALUE - 1);
+			value->v.s[MAX_STRING_VALUE - 1] = 0;
+			break;
+		case TYPE_NULL:
+		case TYPE_LINES:
+			break;
+	}
+}
 
-	/* Default to DEFAULT_PUSH_PERIOD, in case the PAIR command comes before the push interval command */
-	transport.push_period = DEFAULT_PUSH_PERIOD;
+static void prefix_set(tp_prefix_t* prefix, const char* tag)
+{
+	prefix->len = strnlen(tag, TAG_MAX);
+	memcpy(prefix->text, tag, prefix->len);
+	prefix->text[prefix->len++] = '=';
+}
 
-	while (!transport.exit)
+// "TAG=value\r\n" into a buffer of ENTRY_MAX, returns the length, 0 for TYPE_NULL
+static int value_format(char* buf, tp_prefix_t* prefix, tp_value_t* value)
+{
+	int len;
+
+	if (value->type == TYPE_NULL)
+		return 0;
+
+	memcpy(buf, prefix->text, prefix->len);
+	len = prefix->len;
+	switch (value->type)
 	{
-		len = sizeof(cliaddr);
-		n = recvfrom(sockfd, mesg, 1000, 0, (struct sockaddr *)&cliaddr, &len);
-		mesg[n] = 0;
-		printf("-------------------------------------------------------\r\n");
-		printf("Received: %s\r\n\r\n", mesg);
-		
-		i = 0;
-		strcpy(sendmesg, "");
-		while ( (strlen(command_list[i].request) != 0) &&
-		        (strncmp(command_list[i].request, mesg, strlen(command_list[i].request)) != 0) )
+		case TYPE_INTEGER:
+			len += fmt_uint(&buf[len], value->v.u);
+			break;
+		case TYPE_FLOAT:
+			len += fmt_fixed1(&buf[len], value->v.f);
+			break;
+		case TYPE_STRING:
+			len += strnlen(value->v.s, MAX_STRING_VALUE - 1);
+			memcpy(&buf[prefix->len], value->v.s, len - prefix->len);
+			break;
+		case TYPE_NULL:
+		case TYPE_LINES:
+			break;
+	}
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+
+	return len;
+}
+
+// The text form of a binary request entry, the argument of the command
+static void entry_text(frame_entry_t* entry, char* text, int size)
+{
+	int n = 0;
+
+	switch (entry->type)
+	{
+		case TYPE_INTEGER:
+			n = fmt_uint(text, entry->u);
+			break;
+		case TYPE_FLOAT:
+			n = snprintf(text, size, "%.9g", entry->f);
+			break;
+		case TYPE_STRING:
+			n = (entry->slen < size) ? entry->slen : size - 1;
+			memcpy(text, entry->s, n);
+			break;
+		case TYPE_NULL:
+		case TYPE_LINES:
+			break;
+	}
+	text[n] = 0;
+}
+
+// True if value moved more than deadband from last
+static int value_changed(tp_value_t* value, tp_value_t* last, float deadband)
+{
+	float delta = 0;
+
+	switch (value->type)
+	{
+		case TYPE_INTEGER:
+			delta = (float)(int)value->v.u - (float)(int)last->v.u;
+			break;
+		case TYPE_FLOAT:
+			delta = value->v.f - last->v.f;
+			break;
+		case TYPE_STRING:
+			return strcmp(value->v.s, last->v.s) != 0;
+		case TYPE_NULL:
+		case TYPE_LINES:
+			return 0;
+	}
+
+	if (delta < 0)
+		delta = -delta;
+	return delta > deadband;
+}
+
+/*
+ *********************************************************************************
+ * command index
+ *********************************************************************************
+ */
+
+// FNV-1a, seeded so the index build can search for a collision free seed
+static unsigned int cmd_hash(const char* token, int len, unsigned int seed)
+{
+	unsigned int hash = 2166136261u ^ seed;
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)token[i];
+		hash *= 16777619u;
+	}
+
+	return hash & (CMD_HASH_SIZE - 1);
+}
+
+// Find a seed that gives every command its own slot, lookups are then one hash and one compare
+static int cmd_index_build(int count)
+{
+	unsigned int seed, slot;
+	int i;
+
+	for (seed = 0; seed < 10000; seed++)
+	{
+		memset(cmd_index, 0, sizeof(cmd_index));
+		for (i = 0; i < count; i++)
 		{
-			i++;
+			slot = cmd_hash(commandlist[i].request, cmd_len[i], seed);
+			if (cmd_index[slot] != 0)
+				break;
+			cmd_index[slot] = i + 1;
 		}
-
-		if (strlen(command_list[i].request) != 0)
+		
+		if (i == count)
 		{
-			if (command_list[i].commandfunc != NULL)
-			{
-			    // There is a function defined, call the function to get the data string
-			    command_list[i].commandfunc(&mesg[strlen(command_list[i].request) + 1], commandfuncdata);
-			    // Future enhancement: Next, check for command_list[i].data. If not null, build response
-			    //                     string using that data, instead of commandfuncdata.
-			    sprintf(sendmesg, "%s=%s\r\n", command_list[i].tag, commandfuncdata);
-			}
-			else if (command_list[i].data != NULL)
-			{
-			   // There is no function defined, lets 'stringize' the given variable & respond with that
-			    pthread_mutex_lock(&req_lock);
-			    switch (command_list[i].data_type)
-			    {
-				case TYPE_INTEGER:
-				    *(int*)command_list[i].data = strtol(&mesg[strlen(command_list[i].request) + 1], &junk, 0);
-				    sprintf(sendmesg, "%s=%u\r\n", command_list[i].tag, *(int*)command_list[i].data);
-				    break;
-				case TYPE_FLOAT:
-				    *(float*)command_list[i].data = atof(&mesg[strlen(command_list[i].request) + 1]);
-				    sprintf(sendmesg, "%s=%.1f\r\n", command_list[i].tag, *(float*)command_list[i].data);
-				    break;
-				case TYPE_STRING:
-				    strcpy(*(char**)command_list[i].data, &mesg[strlen(command_list[i].request) + 1]);
-				    sprintf(sendmesg, "%s=%s\r\n", command_list[i].tag, *(char**)command_list[i].data);
-				    break;
-				case TYPE_NULL:
-				    break;
-			    }
-			    pthread_mutex_unlock(&req_lock);
-			}
-			
-			sendto(sockfd, sendmesg, sizeof(sendmesg), 0, (struct sockaddr *)&cliaddr, sizeof(cliaddr));				
-			printf("\r\nResponded: %s", sendmesg);
-			printf("-------------------------------------------------------\r\n");
+			cmd_seed = seed;
+			return 0;
 		}
-		else			
-			printf("INVALID COMMAND\r\n");
 	}
 	
-	req_err = 0;
-	return NULL;
+	log_error("Error - no perfect hash for command list");
+	memset(cmd_index, 0, sizeof(cmd_index));
+	return -1;
 }
 
-int tp_handle_data_push(pushlist_t* pushlist, pthread_mutex_t* lock)
+// Exact match of the first token of a request, returns NULL if it is not a command
+static commandlist_t* cmd_lookup(const char* mesg, int* toklen)
 {
-	int iret; 
-	
-	iret = pthread_create( &push_thread, NULL, thread_data_push, (void*)pushlist);
-	if(iret)
+	int len, index;
+
+	len = strcspn(mesg, CMD_SEPARATORS);
+	*toklen = len;
+
+	index = cmd_index[cmd_hash(mesg, len, cmd_seed)];
+	if ((index == 0) || (cmd_len[index - 1] != len) ||
+	    (memcmp(commandlist[index - 1].request, mesg, len) != 0))
+		return NULL;
+
+	return &commandlist[index - 1];
+}
+
+/*
+ *********************************************************************************
+ * events and timers
+ *********************************************************************************
+ */
+
+static void report_event(tp_event_e event, unsigned int value, session_t* s)
+{
+	if (event_handler != NULL)
+		event_handler(event, value, &s->addr);
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void wake_loop(void)
+{
+	uint64_t one = 1;
+
+	if (write(wakefd, &one, sizeof(one)) != sizeof(one))
+		log_error("%s[%u] failed eventfd write", __FUNCTION__, __LINE__);
+}
+
+// Wake at an absolute CLOCK_MONOTONIC time in us, 0 fires right away
+static void arm_timer(uint64_t deadline_us)
+{
+	struct itimerspec its;
+	int flags = TFD_TIMER_ABSTIME;
+
+	memset(&its, 0, sizeof(its));
+	if (deadline_us == 0)
 	{
-		printf("Error - pthread_create() fail\r\n");
-		return -1;
+		its.it_value.tv_nsec = 1;
+		flags = 0;
 	}
 	else
 	{
-		printf("Launching thread push_thread\r\n");
-		return 0;
+		its.it_value.tv_sec = deadline_us / 1000000;
+		its.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
 	}
 	
-	push_lock = *lock;
-	
-	return push_err;
+	if (timerfd_settime(timerfd, flags, &its, NULL))
+		log_error("%s[%u] failed timerfd_settime(): %i", __FUNCTION__, __LINE__, errno);
 }
 
-void *thread_data_push(void *ptr) 
+// Wake at an absolute CLOCK_MONOTONIC time in ms, 0 disarms
+static void arm_delta_timer(uint64_t deadline_ms)
 {
-	int               rc;
-	struct timespec   ts;
-	struct timeval    tp;
-	char sendmesg[100] = {0};
-	
-	pthread_mutex_init(&mutex, NULL);
-	pthread_mutex_lock(&mutex);
-	
-	printf("thread_data_push+++ transport.exit = %d\r\n", transport.exit);
+	struct itimerspec its;
 
-	memset(&alladdr, 0, sizeof(alladdr));
-	alladdr.sin_family = AF_INET;
-	alladdr.sin_addr.s_addr = inet_addr("192.168.1.255");
-	alladdr.sin_port = htons(rtiUdpPort);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline_ms / 1000;
+	its.it_value.tv_nsec = (deadline_ms % 1000) * 1000000;
 
-	pushlist = (pushlist_t*)ptr;
-	
-	while (!transport.exit)
+	if (timerfd_settime(deltafd, TFD_TIMER_ABSTIME, &its, NULL))
+		log_error("%s[%u] failed timerfd_settime(): %i", __FUNCTION__, __LINE__, errno);
+}
+
+/*
+ *********************************************************************************
+ * sessions
+ *********************************************************************************
+ */
+
+// "a.b.c.d:port", for logging from the event loop
+static const char* session_name(session_t* s)
+{
+	static char name[24];
+
+	snprintf(name, sizeof(name), "%s:%u", inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port));
+	return name;
+}
+
+static int pair_message(char* buf)
+{
+	int len;
+
+	memcpy(buf, cmd_prefix[PAIR_COMMAND].text, cmd_prefix[PAIR_COMMAND].len);
+	len = cmd_prefix[PAIR_COMMAND].len;
+	len += fmt_uint(&buf[len], 0);
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+
+	return len;
+}
+
+static uint64_t wheel_tick(uint64_t us)
+{
+	return (us - wheel_start_us) / SUBSCRIBE_TICK_US;
+}
+
+static uint64_t tick_us(uint64_t tick)
+{
+	return wheel_start_us + (tick * SUBSCRIBE_TICK_US);
+}
+
+static uint64_t session_expiry(session_t* s)
+{
+	return s->last_us + ((s->paired ? SESSION_PAIRED_IDLE_S : SESSION_IDLE_S) * 1000000ULL);
+}
+
+// The push timer wakes for the first keyframe or subscription due, session
+// to expire, or PAIR=0 broadcast while nothing is paired
+static void arm_next(void)
+{
+	uint64_t next = UINT64_MAX;
+	int i;
+
+	if ((pushlist != NULL) && (paired_count == 0))
+		next = pair_broadcast_us;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
 	{
-		if (!transport.paired)
-		{
-			sprintf(sendmesg, "%s=0\r\n", commandlist[PAIR_COMMAND].tag);
-			sendto(sockfd, sendmesg, sizeof(sendmesg), 0, (struct sockaddr *)&alladdr, sizeof(alladdr));
-			printf("Broadcasting 'PAIR=0', to establish pairing\r\n");
-			sleep(PAIR_PERIOD);
-		}
-		else
-		{
-			data_push((pushlist_t*)ptr);
-//			sleep(transport.push_period);
-			
-			/* Get absolute time of wait end */
-			rc = gettimeofday(&tp, NULL);
-			if (rc)
-				printf("%s[%u] failed gettimeofday(): %i\r\n", __FUNCTION__, __LINE__, rc);
-			ts.tv_sec  = tp.tv_sec;
-			ts.tv_nsec = tp.tv_usec * 1000;
-			ts.tv_sec += transport.push_period;  // seconds
-			
-			rc = pthread_cond_timedwait(&cond, &mutex, &ts);
-		}
+		if (!sessions[i].in_use)
+			continue;
+		if (session_expiry(&sessions[i]) < next)
+			next = session_expiry(&sessions[i]);
+		if (sessions[i].paired && (pushlist != NULL) && (sessions[i].keyframe_us < next))
+			next = sessions[i].keyframe_us;
+		if (sessions[i].paired && (sessions[i].pending != 0))
+			next = 0;
 	}
-	
-    pthread_mutex_unlock(&mutex);
-	
-	pthread_cond_destroy(&cond);
-	pthread_mutex_destroy(&mutex);
-	push_err = 0;
-	return NULL;
+	if ((wheel.count != 0) && (tick_us(wheel_next(&wheel)) < next))
+		next = tick_us(wheel_next(&wheel));
+
+	if (next != UINT64_MAX)
+		arm_timer(next);
 }
 
-void tp_force_data_push(void)
+static void session_pair(session_t* s, int paired)
 {
-	if (transport.paired)
+	if (!s->paired && paired)
+	{
+		// Start with a keyframe, the deadbands are measured from what it sends
+		memset(s->push_state, 0, sizeof(s->push_state));
+		s->keyframe_us = 0;
+		s->pending = s->rated;
+		paired_count++;
+	}
+	else if (s->paired && !paired)
 	{
-		printf("Asynchronous Push!\r\n");
-		pthread_mutex_lock(&mutex);
-		pthread_cond_signal(&cond);
-		pthread_mutex_unlock(&mutex);
+		paired_count--;
+		if (paired_count == 0)
+			pair_broadcast_us = now_us() + (PAIR_PERIOD * 1000000ULL);
 	}
+	s->paired = paired;
 }
 
-void data_push(pushlist_t* pushlist)
+// Stop the session's subscription timers, before it is dropped or reset
+static void session_cancel(session_t* s)
 {
 	int i;
-	char sendmesg[100] = {0};
-	
-	printf("Pushing data...\r\n");
-	
-	// Send sensor data to host
-	i = 0;
-	while (strlen(pushlist[i].tag) != 0)
+
+	for (i = 0; i < MAX_PUSH_TAGS; i++)
+		wheel_del(&wheel, &s->subscription[i].timer);
+}
+
+// Push pushlist entry tag every rate_s seconds, or on change if 0, starting
+// with its value now. The first single tag replaces the default of every tag.
+static void session_subscribe(session_t* s, int tag, unsigned int rate_s)
+{
+	subscription_t* sub = &s->subscription[tag];
+	uint32_t bit = 1u << tag;
+
+	if (!s->custom)
 	{
-		if (pushlist[i].data_type == TYPE_INTEGER)
-		{
-		    pthread_mutex_lock(&push_lock);
-		    sprintf(sendmesg, "%s=%u\r\n", pushlist[i].tag, *(unsigned int*)pushlist[i].data);
-		    pthread_mutex_unlock(&push_lock);
-		    sendto(sockfd,sendmesg, sizeof(sendmesg), 0, (struct sockaddr *)&cliaddr,sizeof(cliaddr));
-		}
-		else if (pushlist[i].data_type == TYPE_FLOAT)
-		{
-		    pthread_mutex_lock(&push_lock);
-		    sprintf(sendmesg, "%s=%.1f\r\n", pushlist[i].tag, *(float*)pushlist[i].data);
-		    pthread_mutex_unlock(&push_lock);
-		    sendto(sockfd, sendmesg, sizeof(sendmesg), 0, (struct sockaddr *)&cliaddr,sizeof(cliaddr));
-		}
-		else if (pushlist[i].data_type == TYPE_STRING)
-		{
-		    pthread_mutex_lock(&push_lock);
-		    sprintf(sendmesg, "%s=%s\r\n", pushlist[i].tag, (char*)pushlist[i].data);
-		    pthread_mutex_unlock(&push_lock);
-		    sendto(sockfd, sendmesg, sizeof(sendmesg), 0, (struct sockaddr *)&cliaddr,sizeof(cliaddr));
-		}
+		s->subscribed = 0;
+		s->custom = 1;
+	}
 
-		printf("%s", sendmesg);
-		
-		i++;
+	wheel_del(&wheel, &sub->timer);
+	s->subscribed &= ~bit;
+	s->rated &= ~bit;
+	if (rate_s == 0)
+		s->subscribed |= bit;
+	else
+	{
+		s->rated |= bit;
+		sub->session = s;
+		sub->tag = tag;
+		sub->rate_s = rate_s;
+		wheel_add(&wheel, &sub->timer, wheel_tick(now_us()) + rate_s);
 	}
-    
-	sprintf(sendmesg, "%s=%u\r\n", sequence_number.tag, *(unsigned int*)sequence_number.data);
-	sendto(sockfd, sendmesg, sizeof(sendmesg), 0, (struct sockaddr *)&cliaddr,sizeof(cliaddr));
-	printf("%s", sendmesg);
-	
-	transport.sequencenumber++;
+	s->pending |= bit;
+	log_debug("%s subscribed to %s%s", session_name(s), pushlist[tag].tag, rate_s ? ", rated" : "");
+
+	arm_next();
+}
+
+// Stop pushing pushlist entry tag, every entry if tag is MAX_PUSH_TAGS
+static void session_unsubscribe(session_t* s, int tag)
+{
+	uint32_t bits = (tag == MAX_PUSH_TAGS) ? 0xFFFFFFFF : (1u << tag);
+
+	if (tag == MAX_PUSH_TAGS)
+		session_cancel(s);
+	else
+		wheel_del(&wheel, &s->subscription[tag].timer);
+	s->subscribed &= ~bits;
+	s->rated &= ~bits;
+	s->pending &= ~bits;
+	s->custom = 1;
 }
 
+// Back to every entry on change, as a new session starts
+static void session_subscribe_all(session_t* s)
+{
+	session_cancel(s);
+	s->subscribed = 0xFFFFFFFF;
+	s->rated = 0;
+	s->pending = 0xFFFFFFFF;
+	s->custom = 0;
+
+	arm_next();
+}
+
+// Mark the subscriptions that are due for the next push, and start their next period
+static void subscriptions_expire(uint64_t now)
+{
+	wheel_timer_t* timer;
+	subscription_t* sub;
+
+	timer = wheel_advance(&wheel, wheel_tick(now));
+	while (timer != NULL)
+	{
+		sub = (subscription_t*)timer;
+		timer = timer->next;
 
+		sub->session->pending |= 1u << sub->tag;
+		stats_record(STATS_SUB_JITTER, now - tick_us(sub->timer.expires));
+		wheel_add(&wheel, &sub->timer, sub->timer.expires + sub->rate_s);
+	}
+}
+
+// The session of a request from addr, a new one for a new address. Sessions
+// are few, a scan compares less memory than hashing the address would.
+static session_t* session_get(struct sockaddr_in* addr, uint64_t now)
+{
+	session_t* s;
+	session_t* slot = NULL;
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		s = &sessions[i];
+		if (!s->in_use)
+		{
+			if (slot == NULL)
+				slot = s;
+		}
+		else if ((s->addr.sin_addr.s_addr == addr->sin_addr.s_addr) && (s->addr.sin_port == addr->sin_port))
+		{
+			s->last_us = now;
+			return s;
+		}
+	}
+
+	// A full table makes room by dropping the least recently heard unpaired session
+	if (slot == NULL)
+	{
+		for (i = 0; i < MAX_SESSIONS; i++)
+		{
+			s = &sessions[i];
+			if (!s->paired && ((slot == NULL) || (s->last_us < slot->last_us)))
+				slot = s;
+		}
+		if (slot != NULL)
+			log_debug("Session %s dropped for a new one", session_name(slot));
+	}
+	if (slot == NULL)
+		slot = &transient;
+	else
+		session_cancel(slot);
+
+	memset(slot, 0, sizeof(session_t));
+	slot->addr = *addr;
+	slot->in_use = (slot != &transient);
+	slot->push_period = transport.push_period;
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		if (restored[i].in_use && (restored[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr) &&
+		    (restored[i].addr.sin_port == addr->sin_port))
+		{
+			slot->sequencenumber = restored[i].sequencenumber;
+			if (restored[i].push_period > 0)
+				slot->push_period = restored[i].push_period;
+			restored[i].in_use = 0;
+		}
+	}
+	slot->subscribed = 0xFFFFFFFF;
+	slot->last_us = now;
+	log_debug("Session %s started", session_name(slot));
+	arm_next();
+
+	return slot;
+}
+
+// Unpair a session, telling it so, so a processor that is still there pairs again
+static void session_unpair(session_t* s)
+{
+	char sendmesg[ENTRY_MAX];
+
+	sendto(sockfd, sendmesg, pair_message(sendmesg), 0, (struct sockaddr *)&s->addr, sizeof(s->addr));
+	session_pair(s, 0);
+	report_event(TP_EVENT_PAIR, 0, s);
+}
+
+static void sessions_expire(uint64_t now)
+{
+	session_t* s;
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		s = &sessions[i];
+		if (!s->in_use || (session_expiry(s) > now))
+			continue;
+
+		log_info("Session %s expired%s", session_name(s), s->paired ? ", un-paired" : "");
+		if (s->paired)
+			session_unpair(s);
+		session_cancel(s);
+		s->in_use = 0;
+	}
+}
+
+// Read the local interface addresses, off the receive path. After a failure none are known until the next try.
+static void self_addrs_refresh(uint64_t now)
+{
+	struct ifaddrs *ifa, *addrs;
+
+	if ((self_count >= 0) && (now < self_refresh_us))
+		return;
+
+	self_refresh_us = now + (SELF_ADDRS_REFRESH_S * 1000000ULL);
+	if (getifaddrs(&addrs))
+	{
+		log_warn("Local addresses unknown, our own broadcasts may start a session");
+		self_count = -1;
+		return;
+	}
+	self_count = 0;
+	for (ifa = addrs; (ifa != NULL) && (self_count < MAX_SELF_ADDRS); ifa = ifa->ifa_next)
+	{
+		if ((ifa->ifa_addr != NULL) && (ifa->ifa_addr->sa_family == AF_INET))
+			self_addrs[self_count++] = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr;
+	}
+	freeifaddrs(addrs);
+}
+
+// Our own datagrams, the PAIR=0 broadcast comes back to the request socket
+static int self_addr(struct sockaddr_in* from)
+{
+	int i;
+
+	if (from->sin_port != htons(rtiUdpPort))
+		return 0;
+	for (i = 0; i < self_count; i++)
+	{
+		if (self_addrs[i] == from->sin_addr.s_addr)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ *********************************************************************************
+ * event loop
+ *********************************************************************************
+ */
+
+static void loop_init(void)
+{
+	struct epoll_event ev;
+	int err;
+
+	/* Default to DEFAULT_PUSH_PERIOD, in case the PAIR command comes before the push interval command */
+	if (transport.push_period == 0)
+		transport.push_period = DEFAULT_PUSH_PERIOD;
+
+	wheel_start_us = now_us();
+	wheel_init(&wheel, 0);
+	self_addrs_refresh(wheel_start_us);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	deltafd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((epfd < 0) || (timerfd < 0) || (deltafd < 0) || (wakefd < 0))
+	{
+		log_error("Error - event loop descriptors fail");
+		req_err = push_err = -1;
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = timerfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+	ev.data.fd = deltafd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, deltafd, &ev);
+	ev.data.fd = wakefd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+	err = pthread_create( &loop_thread, NULL, thread_event_loop, NULL);
+	if(err)
+	{
+		log_error("Error - pthread_create() fail");
+		req_err = push_err = -1;
+	}
+	else
+	{
+		log_info("Launching thread event_loop");
+	}
+}
+
+static void push_timer_expired(void)
+{
+	char sendmesg[ENTRY_MAX];
+	uint64_t now;
+	int i, due = 0;
+
+	now = now_us();
+	sessions_expire(now);
+	subscriptions_expire(now);
+	self_addrs_refresh(now);
+
+	if ((pushlist != NULL) && (paired_count == 0) && (now >= pair_broadcast_us))
+	{
+		sendto(sockfd, sendmesg, pair_message(sendmesg), 0, (struct sockaddr *)&alladdr, sizeof(alladdr));
+		log_debug("Broadcasting 'PAIR=0', to establish pairing");
+		pair_broadcast_us = now + (PAIR_PERIOD * 1000000ULL);
+	}
+	else if (pushlist != NULL)
+	{
+		for (i = 0; i < MAX_SESSIONS; i++)
+		{
+			if (!sessions[i].in_use || !sessions[i].paired)
+				continue;
+			if (sessions[i].pending != 0)
+				due++;
+			if (sessions[i].keyframe_us > now)
+				continue;
+			// A keyframe due right away, on pairing, has no schedule to be late for
+			if (sessions[i].keyframe_us != 0)
+				stats_record(STATS_PUSH_JITTER, now - sessions[i].keyframe_us);
+			due++;
+		}
+		if (due)
+			data_push(NULL);
+	}
+
+	arm_next();
+}
+
+void *thread_event_loop(void *ptr) 
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t count;
+	int n, i;
+	
+	log_debug("thread_event_loop+++ transport.exit = %d", transport.exit);
+
+	while (!transport.exit)
+	{
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n < 0)
+		{
+			if (errno != EINTR)
+				log_error("%s[%u] failed epoll_wait(): %i", __FUNCTION__, __LINE__, errno);
+			continue;
+		}
+
+		for (i = 0; (i < n) && (!transport.exit); i++)
+		{
+			if (events[i].data.fd == timerfd)
+			{
+				if (read(timerfd, &count, sizeof(count)) == sizeof(count))
+					push_timer_expired();
+			}
+			else if (events[i].data.fd == deltafd)
+			{
+				if ((read(deltafd, &count, sizeof(count)) == sizeof(count)) && paired_count)
+					data_push(NULL);
+			}
+			else if (events[i].data.fd == wakefd)
+			{
+				if ((read(wakefd, &count, sizeof(count)) == sizeof(count)) && force_push)
+				{
+					force_push = 0;
+					if (paired_count)
+						data_push(NULL);
+				}
+			}
+			else
+				handle_request(events[i].data.fd);
+		}
+	}
+	
+	req_err = 0;
+	push_err = 0;
+	return NULL;
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+void tp_stop_handlers()
+{
+	int sockfd, i;
+	char sendmesg[200] = {0};
+
+	transport.exit = 1;
+	if (wakefd >= 0)
+	{
+		wake_loop();
+		pthread_join(loop_thread, NULL);
+	}
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	sprintf(sendmesg, "PAIR=0\r\n");
+	sendto(sockfd, sendmesg, strlen(sendmesg), 0, (struct sockaddr *)&alladdr, sizeof(alladdr));
+	// Paired sessions outside the broadcast subnet are told directly
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		if (sessions[i].in_use && sessions[i].paired)
+			sendto(sockfd, sendmesg, strlen(sendmesg), 0, (struct sockaddr *)&sessions[i].addr, sizeof(sessions[i].addr));
+	}
+	close(sockfd);
+}
+
+int tp_add_socket(int fd)
+{
+	struct epoll_event ev;
+
+	pthread_once(&loop_once, loop_init);
+	if (epfd < 0)
+		return -1;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		log_error("%s[%u] failed epoll_ctl(): %i", __FUNCTION__, __LINE__, errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+void tp_set_event_handler(tp_event_t handler)
+{
+	event_handler = handler;
+}
+
+void tp_restore(tp_event_e event, unsigned int value, const struct sockaddr_in* client)
+{
+	restored_t* r = NULL;
+	int i;
+
+	for (i = 0; (i < MAX_SESSIONS) && (r == NULL); i++)
+	{
+		if (restored[i].in_use && (restored[i].addr.sin_addr.s_addr == client->sin_addr.s_addr) &&
+		    (restored[i].addr.sin_port == client->sin_port))
+			r = &restored[i];
+	}
+	if (r == NULL)
+	{
+		// The client first seen longest ago makes room
+		r = &restored[restored_next];
+		restored_next = (restored_next + 1) % MAX_SESSIONS;
+		memset(r, 0, sizeof(restored_t));
+		r->addr = *client;
+		r->in_use = 1;
+	}
+
+	if (event == TP_EVENT_PUSH)
+		r->sequencenumber = value + 1;
+	else if ((event == TP_EVENT_PUSHPERIOD) && (value > 0))
+		r->push_period = value;
+}
+
+int tp_handle_requests(commandlist_t* device_commandlist, seqlock_t* lock)
+{
+	int i, j;
+
+	// merge device command list, and transport command list
+	i = 0;
+	while(strlen(transport_commands[i].request) != 0)
+	{
+		memcpy((void*)&(commandlist[i]), (void*)&(transport_commands[i]), sizeof(commandlist_t));
+		i++;
+	}
+
+	j = 0;
+	while((strlen(device_commandlist[j].request) != 0) && (i < MAX_COMMANDS - 1))
+	{
+		memcpy((void*)&(commandlist[i]), (void*)&(device_commandlist[j]), sizeof(commandlist_t));
+		i++;
+		j++;
+	}
+	memset(&commandlist[i], 0, sizeof(commandlist_t));
+
+	for (j = 0; j < i; j++)
+	{
+		cmd_len[j] = strlen(commandlist[j].request);
+		prefix_set(&cmd_prefix[j], commandlist[j].tag);
+	}
+	command_count = i;
+	if (cmd_index_build(i))
+		return -1;
+
+	memset(id_index, 0, sizeof(id_index));
+	for (j = 0; j < i; j++)
+	{
+		if (commandlist[j].id == TP_ID_NONE)
+			continue;
+		if ((commandlist[j].id < 0) || (commandlist[j].id >= (int)sizeof(id_index)) || id_index[commandlist[j].id])
+		{
+			log_error("Error - %s has a bad or duplicate binary id %d", commandlist[j].request, commandlist[j].id);
+			continue;
+		}
+		id_index[commandlist[j].id] = j + 1;
+	}
+	
+	req_lock = lock;
+
+	if (tp_add_socket(sockfd))
+		return -1;
+	
+	return req_err;
+}
+
+/*
+ * Run a command: set its variable if arg is not empty, and read it back, or
+ * call its function. Returns 0 with the variable in value, 1 with the
+ * function's text in funcdata, -1 if the command has neither.
+ */
+static int command_run(commandlist_t* command, char* arg, tp_value_t* value, char* funcdata)
+{
+	void* data;
+	char* junk;
+	unsigned int seq;
+	uint64_t waited;
+
+	if (command->commandfunc != NULL)
+	{
+		// There is a function defined, call the function to get the data string
+		funcdata[0] = 0;
+		command->commandfunc(arg, funcdata);
+		// Future enhancement: Next, check for command->data. If not null, build response
+		//                     string using that data, instead of funcdata.
+		return 1;
+	}
+
+	if (command->data == NULL)
+		return -1;
+
+	// There is no function defined, set the variable if a value was given,
+	// then read the variable back
+	data = command->data;
+	if (command->data_type == TYPE_STRING)
+		data = *(char**)data;
+
+	if ((*arg != 0) && (command->data_type != TYPE_NULL))
+	{
+		waited = stats_now_us();
+		seqlock_write_begin(req_lock);
+		stats_record(STATS_LOCK_WAIT, stats_now_us() - waited);
+		switch (command->data_type)
+		{
+			case TYPE_INTEGER:
+				*(int*)data = strtol(arg, &junk, 0);
+				break;
+			case TYPE_FLOAT:
+				*(float*)data = atof(arg);
+				break;
+			case TYPE_STRING:
+				strncpy((char*)data, arg, TP_MAX_STRING - 1);
+				((char*)data)[TP_MAX_STRING - 1] = 0;
+				break;
+			case TYPE_NULL:
+			case TYPE_LINES:
+				break;
+		}
+		seqlock_write_end(req_lock);
+	}
+
+	// Never waits on the sensor thread, a copy that raced a write is taken again
+	do
+	{
+		seq = seqlock_read_begin(req_lock);
+		value_copy(value, command->data_type, data);
+	}
+	while (seqlock_read_retry(req_lock, seq));
+
+	return 0;
+}
+
+// "TAG=value\r\n" for the text protocol, returns the length
+static int text_response(commandlist_t* command, char* mesg, int toklen, char* sendmesg, int size)
+{
+	tp_prefix_t* prefix = &cmd_prefix[command - commandlist];
+	tp_value_t value;
+	char* arg;
+	char funcdata[TP_MAX_RESPONSE];
+	int n;
+
+	// The argument follows the command and one separator, without the line ending
+	arg = &mesg[toklen];
+	if ((*arg == ' ') || (*arg == '='))
+		arg++;
+	arg[strcspn(arg, "\r\n")] = 0;
+	// A cmdfunc's request is no longer than its response buffer, like a binary entry's (entry_text)
+	arg[strnlen(arg, TP_MAX_RESPONSE - 1)] = 0;
+
+	switch (command_run(command, arg, &value, funcdata))
+	{
+		case 0:
+			return value_format(sendmesg, prefix, &value);
+		case 1:
+			if (command->data_type == TYPE_LINES) // already "TAG=value\r\n" lines
+			{
+				n = strnlen(funcdata, (size < TP_MAX_RESPONSE) ? size : TP_MAX_RESPONSE);
+				memcpy(sendmesg, funcdata, n);
+				return n;
+			}
+			n = strnlen(funcdata, size - prefix->len - 2);
+			memcpy(sendmesg, prefix->text, prefix->len);
+			memcpy(&sendmesg[prefix->len], funcdata, n);
+			n += prefix->len;
+			sendmesg[n++] = '\r';
+			sendmesg[n++] = '\n';
+			return n;
+	}
+	return 0;
+}
+
+// A TYPE_LINES command in a binary request, an entry for each pushed value that has
+// a command id, from one snapshot and in its own type rather than parsed back from text
+static int lines_binary(frame_t* frame)
+{
+	tp_value_t values[MAX_PUSH_TAGS];
+	int i, count, full = 0;
+
+	count = (pushlist != NULL) ? push_snapshot(values) : 0;
+	for (i = 0; (i < count) && !full; i++)
+	{
+		if (push_id[i] >= 0)
+			full = frame_put(frame, push_id[i], values[i].type, &values[i].v);
+	}
+
+	return full;
+}
+
+/*
+ * Run each line of a text request, up to MAX_BATCH of them, and answer them
+ * in order in one datagram. A line that is not a command, or is as long as
+ * a cmdfunc's buffer (TP_MAX_RESPONSE), gets no answer.
+ * Answers stop at the first one that does not fit, the client asks again
+ * for the rest. Returns the length.
+ */
+static int batch_response(char* mesg, char* sendmesg, int size)
+{
+	commandlist_t* command;
+	char* line;
+	char* next;
+	char entry[PUSH_MTU];
+	int len, toklen, count = 0, sendlen = 0;
+
+	for (line = mesg; (*line != 0) && (count < MAX_BATCH); line = next)
+	{
+		len = strcspn(line, "\r\n");
+		next = &line[len];
+		next += strspn(next, "\r\n");
+		if (len == 0)
+			continue;
+		line[len] = 0;
+		count++;
+
+		// No command or argument is longer than the buffers they are run with
+		if (len >= TP_MAX_RESPONSE)
+		{
+			log_warn("COMMAND TOO LONG (%d bytes) %.20s", len, line);
+			continue;
+		}
+		if ((command = cmd_lookup(line, &toklen)) == NULL)
+		{
+			log_warn("INVALID COMMAND %s", line);
+			continue;
+		}
+		log_debug("Received from %s: %s", session_name(session), line);
+
+		// The first answer goes straight in, the rest are appended if they fit
+		if (sendlen == 0)
+		{
+			sendlen = text_response(command, line, toklen, sendmesg, size);
+			continue;
+		}
+		len = text_response(command, line, toklen, entry, sizeof(entry));
+		if ((sendlen + len) > size)
+		{
+			log_warn("Response full, %s and the rest are not answered", line);
+			break;
+		}
+		memcpy(&sendmesg[sendlen], entry, len);
+		sendlen += len;
+	}
+	if ((*line != 0) && (count == MAX_BATCH))
+		log_warn("More than %d commands in a request, the rest are ignored", MAX_BATCH);
+
+	return sendlen;
+}
+
+// Run every entry of a binary request, and answer them in one binary response. Returns its length.
+static int binary_response(char* mesg, int len, char* sendmesg, int size)
+{
+	commandlist_t* command;
+	frame_reader_t reader;
+	frame_entry_t entry;
+	frame_t frame;
+	tp_value_t value;
+	unsigned int seq;
+	int err, full = 0;
+	char arg[TP_MAX_RESPONSE];
+	char funcdata[TP_MAX_RESPONSE];
+
+	if (frame_open(&reader, mesg, len, &seq) != FRAME_REQUEST)
+		return 0;
+
+	frame_begin(&frame, sendmesg, size, FRAME_RESPONSE, seq);
+	while ((err = frame_next(&reader, &entry)) == 0)
+	{
+		if ((entry.id >= sizeof(id_index)) || (id_index[entry.id] == 0))
+		{
+			frame_put(&frame, entry.id, TYPE_NULL, NULL);
+			continue;
+		}
+
+		command = &commandlist[id_index[entry.id] - 1];
+		if (command->data_type == TYPE_LINES)
+		{
+			full = lines_binary(&frame);
+			if (full)
+				break;
+			continue;
+		}
+		entry_text(&entry, arg, sizeof(arg));
+		switch (command_run(command, arg, &value, funcdata))
+		{
+			case 0:
+				full = frame_put(&frame, entry.id, value.type, &value.v);
+				break;
+			case 1:
+				// The function answers in text, send it as the command's type
+				if (command->data_type == TYPE_INTEGER)
+				{
+					value.v.u = strtoul(funcdata, NULL, 0);
+					full = frame_put(&frame, entry.id, TYPE_INTEGER, &value.v.u);
+				}
+				else if (command->data_type == TYPE_FLOAT)
+				{
+					value.v.f = strtof(funcdata, NULL);
+					full = frame_put(&frame, entry.id, TYPE_FLOAT, &value.v.f);
+				}
+				else
+					full = frame_put(&frame, entry.id, TYPE_STRING, funcdata);
+				break;
+			default:
+				full = frame_put(&frame, entry.id, TYPE_NULL, NULL);
+				break;
+		}
+		if (full)
+			break; // the response is full, the client asks again for the rest
+	}
+	if (err < 0)
+		log_warn("Malformed binary request");
+
+	return frame_end(&frame);
+}
+
+// Worth a session: a binary request frame, or text with at least one known command
+static int request_valid(char* mesg, int n)
+{
+	frame_reader_t reader;
+	unsigned int seq;
+	char* line;
+	int toklen;
+
+	if ((n > 0) && ((unsigned char)mesg[0] == FRAME_MAGIC))
+		return frame_open(&reader, mesg, n, &seq) == FRAME_REQUEST;
+
+	for (line = mesg + strspn(mesg, "\r\n"); *line != 0; line += strspn(line, "\r\n"))
+	{
+		if (cmd_lookup(line, &toklen) != NULL)
+			return 1;
+		line += strcspn(line, "\r\n");
+	}
+	return 0;
+}
+
+void handle_request(int fd) 
+{
+	struct sockaddr_in from;
+	int n, sendlen;
+	int paired, push_period;
+	uint64_t received;
+	socklen_t len;
+	char mesg[PUSH_MTU + 1];
+	char sendmesg[PUSH_MTU];
+
+	// Drain the socket, it is non-blocking
+	while (!transport.exit)
+	{
+		len = sizeof(from);
+		n = recvfrom(fd, mesg, sizeof(mesg) - 1, 0, (struct sockaddr *)&from, &len);
+		if (n < 0)
+			break;
+		mesg[n] = 0;
+		received = stats_now_us();
+
+		// Junk and our own broadcasts would fill the session table, and evict real clients
+		if (self_addr(&from))
+			continue;
+		if (!request_valid(mesg, n))
+		{
+			log_warn("INVALID REQUEST from %s:%u", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+			continue;
+		}
+		
+		session = session_get(&from, now_us());
+		paired = session->paired;
+		push_period = session->push_period;
+
+		if ((n > 0) && ((unsigned char)mesg[0] == FRAME_MAGIC))
+		{
+			log_debug("Received from %s: binary, %d bytes", session_name(session), n);
+			sendlen = binary_response(mesg, n, sendmesg, sizeof(sendmesg));
+			sendto(fd, sendmesg, sendlen, 0, (struct sockaddr *)&from, sizeof(from));
+			stats_record(STATS_REQUEST, stats_now_us() - received);
+			log_debug("Responded: binary, %d bytes", sendlen);
+		}
+		else if ((sendlen = batch_response(mesg, sendmesg, sizeof(sendmesg))) > 0)
+		{
+			sendto(fd, sendmesg, sendlen, 0, (struct sockaddr *)&from, sizeof(from));
+			stats_record(STATS_REQUEST, stats_now_us() - received);
+			log_debug("Responded: %.*s", (sendlen > 2) ? sendlen - 2 : 0, sendmesg);
+		}
+
+		// Pairing, or a new push period, takes effect now rather than at the end of the current wait
+		if ((session->paired != paired) || (session->push_period != push_period))
+			arm_next();
+
+		if (session->paired != paired)
+			report_event(TP_EVENT_PAIR, session->paired, session);
+		if (session->push_period != push_period)
+			report_event(TP_EVENT_PUSHPERIOD, session->push_period, session);
+		if (transport.exit)
+			report_event(TP_EVENT_SHUTDOWN, transport.exit, session);
+	}
+}
+
+int tp_handle_data_push(pushlist_t* pushdata, seqlock_t* lock)
+{
+	int i, j;
+
+	pthread_once(&loop_once, loop_init);
+	if (epfd < 0)
+		return -1;
+
+	memset(&alladdr, 0, sizeof(alladdr));
+	alladdr.sin_family = AF_INET;
+	alladdr.sin_addr.s_addr = inet_addr("192.168.1.255");
+	alladdr.sin_port = htons(rtiUdpPort);
+
+	push_lock = lock;
+	pushlist = pushdata;
+	for (i = 0; (i < MAX_PUSH_TAGS) && (strlen(pushlist[i].tag) != 0); i++)
+	{
+		prefix_set(&push_prefix[i], pushlist[i].tag);
+
+		// Binary pushes carry the id of the command that reads the same tag
+		for (j = 0; (j < command_count) && strcmp(commandlist[j].tag, pushlist[i].tag); j++);
+		push_id[i] = (j < command_count) ? commandlist[j].id : TP_ID_NONE;
+		if (push_id[i] < 0)
+			log_warn("Push tag %s has no command, it is left out of binary pushes", pushlist[i].tag);
+	}
+	prefix_set(&seq_prefix, sequence_number.tag);
+
+	// Start pushing, or advertising the need to pair, right away
+	arm_timer(0);
+	
+	return push_err;
+}
+
+void tp_force_data_push(void)
+{
+	if (paired_count)
+	{
+		force_push = 1;
+		wake_loop();
+	}
+}
+
+// Add one "TAG=value\r\n" entry, starting a new frame when the current one is full
+static void push_append(push_frame_t* frames, int* nframes, char* entry, int len)
+{
+	push_frame_t* frame = &frames[*nframes - 1];
+
+	if ((frame->len + len) > PUSH_MTU)
+	{
+		if (*nframes == MAX_PUSH_FRAMES)
+		{
+			log_error("%s[%u] push list exceeds %u frames", __FUNCTION__, __LINE__, MAX_PUSH_FRAMES);
+			return;
+		}
+		frame = &frames[(*nframes)++];
+		frame->len = 0;
+	}
+
+	memcpy(&frame->data[frame->len], entry, len);
+	frame->len += len;
+}
+
+// Add one binary entry, starting a new frame when the current one is full.
+// Returns 0 if the entry was left out, it has no id or there is no room.
+static int push_append_binary(push_frame_t* frames, int* nframes, frame_t* frame, int id, tp_value_t* value, unsigned int seq)
+{
+	if (id < 0)
+		return 0;
+	if (frame_put(frame, id, value->type, &value->v) == 0)
+		return 1;
+
+	if (*nframes == MAX_PUSH_FRAMES)
+	{
+		log_error("%s[%u] push list exceeds %u frames", __FUNCTION__, __LINE__, MAX_PUSH_FRAMES);
+		return 0;
+	}
+	frames[*nframes - 1].len = frame_end(frame);
+	frame_begin(frame, frames[(*nframes)++].data, PUSH_MTU, FRAME_PUSH, seq);
+	return frame_put(frame, id, value->type, &value->v) == 0;
+}
+
+// Should entry i go out now, given the value just read
+static int push_due(pushlist_t* entry, push_state_t* state, tp_value_t* value, uint64_t now)
+{
+	uint64_t elapsed = now - state->sent_ms;
+
+	if (value_changed(value, &state->value, entry->deadband) && (elapsed >= entry->min_interval_ms))
+		return 1;
+	return (entry->max_interval_ms != 0) && (elapsed >= entry->max_interval_ms);
+}
+
+// Earliest time an entry of a session could become due without a new change, 0 if none
+static uint64_t push_next_deadline(session_t* session, tp_value_t* values, int count)
+{
+	push_state_t* state = session->push_state;
+	uint64_t deadline, next = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!(session->subscribed & (1u << i)))
+			continue;
+
+		deadline = 0;
+		// A change held back by min_interval
+		if (value_changed(&values[i], &state[i].value, pushlist[i].deadband))
+			deadline = state[i].sent_ms + pushlist[i].min_interval_ms;
+		else if (pushlist[i].max_interval_ms != 0)
+			deadline = state[i].sent_ms + pushlist[i].max_interval_ms;
+
+		if ((deadline != 0) && ((next == 0) || (deadline < next)))
+			next = deadline;
+	}
+
+	return next;
+}
+
+// Take one consistent snapshot of every pushed value, without blocking the sensor thread.
+// Returns the number of pushlist entries.
+static int push_snapshot(tp_value_t* values)
+{
+	unsigned int seq;
+	int i, count;
+
+	count = 0;
+	while ((count < MAX_PUSH_TAGS) && (pushlist[count].tag[0] != 0))
+		count++;
+
+	do
+	{
+		seq = seqlock_read_begin(push_lock);
+		for (i = 0; i < count; i++)
+			value_copy(&values[i], pushlist[i].data_type, pushlist[i].data);
+	}
+	while (seqlock_read_retry(push_lock, seq));
+
+	return count;
+}
+
+// GETALL, every pushed value from one snapshot, as "TAG=value\r\n" lines like a keyframe
+int getall(char* request, char* response)
+{
+	tp_value_t values[MAX_PUSH_TAGS];
+	char entry[ENTRY_MAX];
+	int i, count, len, n = 0;
+
+	count = (pushlist != NULL) ? push_snapshot(values) : 0;
+	for (i = 0; i < count; i++)
+	{
+		len = value_format(entry, &push_prefix[i], &values[i]);
+		if ((n + len) >= TP_MAX_RESPONSE)
+			break;
+		memcpy(&response[n], entry, len);
+		n += len;
+	}
+	response[n] = 0;
+
+	return 0;
+}
+
+// Pack the session's entries in force, and the subscribed ones that are due, and
+// its sequence number, into as few datagrams as fit the MTU. Returns 0 if nothing is due.
+int push_serialize(session_t* session, tp_value_t* values, int count, uint32_t force, uint64_t now, push_frame_t* frames)
+{
+	push_state_t* state = session->push_state;
+	int i, len, due, binary;
+	int nframes = 1;
+	tp_value_t seqvalue;
+	frame_t frame;
+	char sendmesg[ENTRY_MAX];
+
+	// Frames carry the sequence number in their header in binary
+	binary = (session->paired == TP_PAIR_BINARY);
+	frames[0].len = 0;
+	if (binary)
+		frame_begin(&frame, frames[0].data, PUSH_MTU, FRAME_PUSH, session->sequencenumber);
+
+	due = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (!(force & (1u << i)) &&
+		    (!(session->subscribed & (1u << i)) || !push_due(&pushlist[i], &state[i], &values[i], now)))
+			continue;
+
+		// Only what went in counts, but the state moves on either way, or an entry with no id would stay due
+		if (binary)
+			due += push_append_binary(frames, &nframes, &frame, push_id[i], &values[i], session->sequencenumber);
+		else if ((len = value_format(sendmesg, &push_prefix[i], &values[i])) > 0)
+		{
+			push_append(frames, &nframes, sendmesg, len);
+			due++;
+		}
+		state[i].value = values[i];
+		state[i].sent_ms = now;
+	}
+
+	if (due == 0)
+		return 0;
+	if (binary)
+	{
+		frames[nframes - 1].len = frame_end(&frame);
+		return nframes;
+	}
+    
+	seqvalue.type = TYPE_INTEGER;
+	seqvalue.v.u = session->sequencenumber;
+	len = value_format(sendmesg, &seq_prefix, &seqvalue);
+	push_append(frames, &nframes, sendmesg, len);
+
+	return nframes;
+}
+
+// Send a batch of datagrams in as few sendmmsg calls as possible
+int push_send(struct mmsghdr* msgs, int n)
+{
+	int i, sent;
+
+	for (i = 0; i < n; i += sent)
+	{
+		sent = sendmmsg(sockfd, &msgs[i], n - i, 0);
+		if (sent <= 0)
+		{
+			log_error("%s[%u] failed sendmmsg(): %i", __FUNCTION__, __LINE__, errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Push to every paired session: a keyframe of its on change entries to those
+ * that are due one, the entries that moved past their deadband to the others,
+ * and to each the rated entries that are due. With only set, push every entry
+ * to that session alone. The values are read once, and every session's
+ * datagrams go out in one batch.
+ */
+void data_push(session_t* only)
+{
+	struct mmsghdr msgs[MAX_SESSIONS * MAX_PUSH_FRAMES];
+	struct iovec iovs[MAX_SESSIONS * MAX_PUSH_FRAMES];
+	tp_value_t values[MAX_PUSH_TAGS];
+	session_t* pushed[MAX_SESSIONS];
+	session_t* s;
+	uint64_t start, now, deadline, next;
+	uint32_t force;
+	int i, f, count, keyframe, nframes, nmsgs, nsessions, bytes;
+	
+	if (pushlist == NULL)
+		return;
+
+	// Send sensor data to host
+	start = stats_now_us();
+	count = push_snapshot(values);
+	now = now_us();
+
+	memset(msgs, 0, sizeof(msgs));
+	nmsgs = 0;
+	nsessions = 0;
+	bytes = 0;
+	for (i = 0; i < ((only != NULL) ? 1 : MAX_SESSIONS); i++)
+	{
+		s = (only != NULL) ? only : &sessions[i];
+		if ((only == NULL) && (!s->in_use || !s->paired))
+			continue;
+
+		keyframe = (s == only) || (s->keyframe_us <= now);
+		if (s->keyframe_us <= now)
+			s->keyframe_us = now + (s->push_period * 1000000ULL);
+		force = s->pending;
+		if (keyframe)
+			force |= s->subscribed | ((s == only) ? s->rated : 0);
+		s->pending = 0;
+
+		nframes = push_serialize(s, values, count, force, now / 1000, &push_frames[nmsgs]);
+		if (nframes == 0)
+			continue;
+
+		for (f = 0; f < nframes; f++, nmsgs++)
+		{
+			iovs[nmsgs].iov_base = push_frames[nmsgs].data;
+			iovs[nmsgs].iov_len = push_frames[nmsgs].len;
+			msgs[nmsgs].msg_hdr.msg_name = &s->addr;
+			msgs[nmsgs].msg_hdr.msg_namelen = sizeof(s->addr);
+			msgs[nmsgs].msg_hdr.msg_iov = &iovs[nmsgs];
+			msgs[nmsgs].msg_hdr.msg_iovlen = 1;
+			bytes += push_frames[nmsgs].len;
+		}
+		log_debug("%s %s: sequence %u, %d frames", keyframe ? "Pushed data to" : "Pushed changes to",
+		          session_name(s), s->sequencenumber, nframes);
+
+		report_event(TP_EVENT_PUSH, s->sequencenumber, s);
+		s->sequencenumber++;
+		pushed[nsessions++] = s;
+	}
+
+	// Wake for the first entry of any session held back by min_interval, or due by max_interval
+	next = 0;
+	for (i = 0; i < MAX_SESSIONS; i++)
+	{
+		if (!sessions[i].in_use || !sessions[i].paired)
+			continue;
+		deadline = push_next_deadline(&sessions[i], values, count);
+		if ((deadline != 0) && ((next == 0) || (deadline < next)))
+			next = deadline;
+	}
+	arm_delta_timer(next);
+
+	if (nmsgs == 0)
+		return;
+
+	// A paired client may only ever listen, a push it was sent keeps its session
+	if (push_send(msgs, nmsgs) == 0)
+	{
+		for (i = 0; i < nsessions; i++)
+			pushed[i]->last_us = now;
+	}
+	stats_record(STATS_PUSH, stats_now_us() - start);
+	log_debug("Pushed to %d sessions, %d frames, %d bytes", nsessions, nmsgs, bytes);
+}
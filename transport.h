@@ -1,14 +1,41 @@
 
 
+#include <netinet/in.h>
+
 typedef enum {
 	TYPE_NULL,
 	TYPE_INTEGER,
 	TYPE_FLOAT,
-	TYPE_STRING
+	TYPE_STRING,
+	TYPE_LINES   // a cmdfunc answering with "TAG=value\r\n" lines of push list values
 } data_type_e;
 
+#define TP_MAX_RESPONSE 1024 // size of the response buffer handed to a cmdfunc, its request is shorter
+#define TP_MAX_STRING 80 // size of the buffer a TYPE_STRING variable points to
+
 typedef int (*cmdfunc)(char* request, char* response);
 
+// Transport state changes of a client session, reported from the event loop thread
+typedef enum {
+	TP_EVENT_PAIR,       // value is the new pairing
+	TP_EVENT_PUSH,       // value is the sequence number just pushed
+	TP_EVENT_PUSHPERIOD, // value is the new push period
+	TP_EVENT_SHUTDOWN    // the SHUTDOWN command stopped the transport
+} tp_event_e;
+
+typedef void (*tp_event_t)(tp_event_e event, unsigned int value, const struct sockaddr_in* client);
+
+#define TP_PAIR_BINARY 2 // SETPAIR 2 pairs for binary pushes, see frame.h
+
+/*
+ * Binary frame ids are fixed per command, so clients keep working as commands
+ * are added. The transport's own commands use 0-6 and 240-255, an application
+ * picks its ids from the rest.
+ */
+#define TP_ID_APP_FIRST 7
+#define TP_ID_APP_LAST 239
+#define TP_ID_NONE -1 // not reachable from binary requests
+
 typedef struct 
 {
 	char request[20];
@@ -16,18 +43,33 @@ typedef struct
 	cmdfunc commandfunc;
 	data_type_e data_type;
 	void* data;
+	int id; // binary frame id
 } commandlist_t;
 
+/*
+ * An entry is pushed when it moves more than deadband from the value last
+ * pushed, but no sooner than min_interval_ms after that push. It is pushed
+ * anyway after max_interval_ms, if not 0. Every entry is pushed as a
+ * keyframe each push period. Entries left 0 push on any change.
+ */
 typedef struct 
 {
 	char tag[20];
 	data_type_e data_type;
 	void* data;
+	float deadband;
+	unsigned int min_interval_ms;
+	unsigned int max_interval_ms;
 } pushlist_t;
 
-int tp_handle_requests(commandlist_t* device_commandlist, pthread_mutex_t* lock);
-int tp_handle_data_push(pushlist_t* pushdata, pthread_mutex_t* lock);
+int tp_handle_requests(commandlist_t* device_commandlist, seqlock_t* lock);
+int tp_handle_data_push(pushlist_t* pushdata, seqlock_t* lock);
 void tp_stop_handlers(void);
-void tp_force_data_push(void);
+void tp_force_data_push(void); // the data changed, push the entries that moved past their deadband
+int tp_add_socket(int fd);
+void tp_set_event_handler(tp_event_t handler);
+// Replay an event of a client from a previous run, its session resumes with the
+// sequence number and push period they leave. Call before the handlers start.
+void tp_restore(tp_event_e event, unsigned int value, const struct sockaddr_in* client);
 
 
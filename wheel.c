@@ -0,0 +1,200 @@
+/*
+ * wheel.c:
+ *      Hierarchical timer wheel
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_SPAN ((uint64_t)WHEEL_SIZE * WHEEL_SIZE) // ticks the second level reaches
+
+/*
+ *********************************************************************************
+ * support functions
+ *********************************************************************************
+ */
+
+static uint64_t rotate_right(uint64_t bits, int shift)
+{
+	return (bits >> shift) | (bits << ((64 - shift) & 63));
+}
+
+// Ticks from the one after now to the next occupied slot of a level, -1 if none
+static int next_slot(uint64_t occupied, int from)
+{
+	if (occupied == 0)
+		return -1;
+	return __builtin_ctzll(rotate_right(occupied, from));
+}
+
+static void slot_insert(wheel_t* wheel, int level, int slot, wheel_timer_t* timer)
+{
+	wheel_timer_t** head = &wheel->slot[level][slot];
+
+	timer->next = *head;
+	if (timer->next != NULL)
+		timer->next->pprev = &timer->next;
+	*head = timer;
+	timer->pprev = head;
+	timer->where = (level * WHEEL_SIZE) + slot;
+	wheel->occupied[level] |= 1ULL << slot;
+}
+
+// Take a slot's whole list, the timers are no longer pending
+static wheel_timer_t* slot_take(wheel_t* wheel, int level, int slot)
+{
+	wheel_timer_t* list = wheel->slot[level][slot];
+	wheel_timer_t* timer;
+
+	wheel->slot[level][slot] = NULL;
+	wheel->occupied[level] &= ~(1ULL << slot);
+	for (timer = list; timer != NULL; timer = timer->next)
+		timer->pprev = NULL;
+
+	return list;
+}
+
+// Put a timer in the slot for its expiry, which is no earlier than wheel->now
+static void place(wheel_t* wheel, wheel_timer_t* timer)
+{
+	uint64_t delta = timer->expires - wheel->now;
+	uint64_t at;
+
+	if (delta < WHEEL_SIZE)
+		slot_insert(wheel, 0, timer->expires & WHEEL_MASK, timer);
+	else
+	{
+		// Too far out for the second level, wait in the last slot it reaches
+		at = (delta < WHEEL_SPAN) ? timer->expires : wheel->now + WHEEL_SPAN - 1;
+		slot_insert(wheel, 1, (at >> WHEEL_BITS) & WHEEL_MASK, timer);
+	}
+}
+
+/*
+ *********************************************************************************
+ * interface functions
+ *********************************************************************************
+ */
+
+void wheel_init(wheel_t* wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(wheel_t));
+	wheel->now = now;
+}
+
+void wheel_add(wheel_t* wheel, wheel_timer_t* timer, uint64_t expires)
+{
+	wheel_del(wheel, timer);
+	timer->expires = (expires > wheel->now) ? expires : wheel->now + 1;
+	place(wheel, timer);
+	wheel->count++;
+}
+
+void wheel_del(wheel_t* wheel, wheel_timer_t* timer)
+{
+	int level, slot;
+
+	if (timer->pprev == NULL)
+		return;
+
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	wheel->count--;
+
+	level = timer->where / WHEEL_SIZE;
+	slot = timer->where % WHEEL_SIZE;
+	if (wheel->slot[level][slot] == NULL)
+		wheel->occupied[level] &= ~(1ULL << slot);
+}
+
+int wheel_pending(wheel_timer_t* timer)
+{
+	return timer->pprev != NULL;
+}
+
+uint64_t wheel_next(wheel_t* wheel)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t boundary;
+	int k;
+
+	if (wheel->count == 0)
+		return UINT64_MAX;
+
+	k = next_slot(wheel->occupied[0], (wheel->now + 1) & WHEEL_MASK);
+	if (k >= 0)
+		next = wheel->now + 1 + k;
+
+	// The first level wraps every WHEEL_SIZE ticks, and takes one second level slot down
+	boundary = (wheel->now | WHEEL_MASK) + 1;
+	k = next_slot(wheel->occupied[1], (boundary >> WHEEL_BITS) & WHEEL_MASK);
+	if ((k >= 0) && ((boundary + ((uint64_t)k << WHEEL_BITS)) < next))
+		next = boundary + ((uint64_t)k << WHEEL_BITS);
+
+	return next;
+}
+
+wheel_timer_t* wheel_advance(wheel_t* wheel, uint64_t now)
+{
+	wheel_timer_t* expired = NULL;
+	wheel_timer_t* list;
+	wheel_timer_t* timer;
+	uint64_t tick;
+
+	while (wheel->now < now)
+	{
+		// Skip straight to the next tick with work
+		tick = wheel_next(wheel);
+		if (tick > now)
+		{
+			wheel->now = now;
+			break;
+		}
+		wheel->now = tick;
+
+		if ((tick & WHEEL_MASK) == 0)
+		{
+			list = slot_take(wheel, 1, (tick >> WHEEL_BITS) & WHEEL_MASK);
+			while ((timer = list) != NULL)
+			{
+				list = timer->next;
+				place(wheel, timer);
+			}
+		}
+
+		list = slot_take(wheel, 0, tick & WHEEL_MASK);
+		while ((timer = list) != NULL)
+		{
+			list = timer->next;
+			timer->next = expired;
+			expired = timer;
+			wheel->count--;
+		}
+	}
+
+	return expired;
+}
@@ -0,0 +1,72 @@
+/*
+ * wheel.h:
+ *      Hierarchical timer wheel
+ *
+ *	Two levels of 64 slots: the first holds timers due in the next 64
+ *	ticks, one slot per tick, the second those due in the next 4096, one
+ *	slot per 64 ticks. Every 64 ticks the next second level slot is
+ *	cascaded down into the first. A tick costs the timers that expire on
+ *	it plus, every 64th tick, the ones cascaded, whatever the total. Timers
+ *	further out than 4096 ticks wait in the last reachable slot and are
+ *	placed again when it cascades. An occupancy mask per level finds the
+ *	next busy slot without visiting the empty ones.
+ *
+ *	The caller embeds a wheel_timer_t in its own struct, and owns the
+ *	memory. The wheel is not locked, use it from one thread.
+ *
+ * Copyright (c) 2014 Eric Nelson
+ ***********************************************************************
+ * This file uses wiringPi:
+ *	https://projects.drogon.net/raspberry-pi/wiringpi/
+ *
+ *    wiringPi is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    wiringPi is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public License
+ *    along with wiringPi.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************
+ */
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 2
+
+typedef struct wheel_timer
+{
+	struct wheel_timer* next;
+	struct wheel_timer** pprev; // the pointer to this timer, NULL when not pending
+	uint64_t expires;           // tick
+	int where;                  // level * WHEEL_SIZE + slot
+} wheel_timer_t;
+
+typedef struct
+{
+	wheel_timer_t* slot[WHEEL_LEVELS][WHEEL_SIZE];
+	uint64_t occupied[WHEEL_LEVELS]; // bit i set if slot i is not empty
+	uint64_t now;                    // the last tick advanced to
+	int count;
+} wheel_t;
+
+void wheel_init(wheel_t* wheel, uint64_t now);
+// Start timer to expire at tick expires, a tick already past expires at the next one
+void wheel_add(wheel_t* wheel, wheel_timer_t* timer, uint64_t expires);
+void wheel_del(wheel_t* wheel, wheel_timer_t* timer);
+int wheel_pending(wheel_timer_t* timer);
+// Advance to tick now, returns the timers that expired, linked by next
+wheel_timer_t* wheel_advance(wheel_t* wheel, uint64_t now);
+// The next tick wheel_advance has work on, UINT64_MAX if the wheel is empty
+uint64_t wheel_next(wheel_t* wheel);
+
+#endif